@@ -32,6 +32,8 @@ char *funcNames[] = {
         "equal",
         "less",
         "greater",
+        "memstats",
+        "cachestats",
         ""
 };
 
@@ -59,7 +61,7 @@ AST_NODE *createNumberNode(double value, NUM_TYPE type)
 
     // allocate space for the fixed sie and the variable part (union)
     nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    if ((node = ciLispAlloc(nodeSize, MEM_NUM_NODE)) == NULL)
         yyerror("Memory allocation failed!");
 
     // TODO set the AST_NODE's type, assign values to contained NUM_AST_NODE done
@@ -84,7 +86,7 @@ AST_NODE *createFunctionNode(char *funcName, AST_NODE *opList)
 
     // allocate space (or error)
     nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    if ((node = ciLispAlloc(nodeSize, MEM_FUNC_NODE)) == NULL)
         yyerror("Memory allocation failed!");
 
     // TODO set the AST_NODE's type, populate contained FUNC_AST_NODE done
@@ -99,6 +101,8 @@ AST_NODE *createFunctionNode(char *funcName, AST_NODE *opList)
     AST_NODE *curNode = node->data.function.opList;
     if (node->data.function.oper == CUSTOM_OPER){
         node->data.function.ident = funcName;
+    } else {
+        ciLispFree(funcName);
     }
     while (curNode != NULL){
         curNode->parent = node;
@@ -112,7 +116,7 @@ AST_NODE *createSymbolNode(char* symbol){
     size_t nodeSize;
 
     nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    if ((node = ciLispAlloc(nodeSize, MEM_SYM_NODE)) == NULL)
         yyerror("Memory allocation failed!");
 
     node->type = SYM_NODE_TYPE;
@@ -125,18 +129,26 @@ SYM_TABLE_NODE *createSymbolTableNode(AST_NODE *value, char *identifier, char *t
     SYM_TABLE_NODE *node;
     size_t nodeSize;
 
+    if (value == NULL){
+        ciLispFree(identifier);
+        ciLispFree(type);
+        return NULL;
+    }
+
     nodeSize = sizeof(SYM_TABLE_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    if ((node = ciLispAlloc(nodeSize, MEM_SYM_TABLE)) == NULL)
         yyerror("Memory allocation failed!");
 
     node->id = identifier;
     node->value = value;
+    node->impure = false;
     node->next = NULL;
     node->type = VARIABLE_TYPE;
     if (type == NULL){
         node->val_type = NO_TYPE;
     } else if(strcmp("double", type) == 0) node->val_type = DOUBLE_TYPE;
     else node->val_type = INT_TYPE;
+    ciLispFree(type);
 
     return node;
 
@@ -146,35 +158,54 @@ SYM_TABLE_NODE *createLambdaSymbolTableNode(AST_NODE *value, char *id, char *typ
     SYM_TABLE_NODE *node;
     size_t nodeSize;
 
+    if (value == NULL){
+        ciLispFree(id);
+        ciLispFree(type);
+        freeArgTable(arg);
+        return NULL;
+    }
+
     nodeSize = sizeof(SYM_TABLE_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    if ((node = ciLispAlloc(nodeSize, MEM_SYM_TABLE)) == NULL)
         yyerror("Memory allocation failed!");
 
     node->type = LAMBDA_TYPE;
     node->value = value;
+    node->impure = false;
     node->id = id;
     node->value->argTable = arg;
     if (type == NULL){
         node->val_type = NO_TYPE;
     } else if(strcmp("double", type) == 0) node->val_type = DOUBLE_TYPE;
     else node->val_type = INT_TYPE;
+    ciLispFree(type);
     return node;
 
 }
 
 
+// Called for a top-level (lambda (params) body) (see ciLisp.y).
+// Like a let lambda the params are stored as the body's arg table; compiled programs take them as inputs.
+AST_NODE *createLambdaNode(ARG_TABLE_NODE *arg, AST_NODE *body){
+    body->argTable = arg;
+    return body;
+}
+
 ARG_TABLE_NODE *createArgTableNode(char *id){
     ARG_TABLE_NODE *node;
     size_t nodeSize;
     nodeSize = sizeof(ARG_TABLE_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    if ((node = ciLispAlloc(nodeSize, MEM_ARG_TABLE)) == NULL)
         yyerror("Memory allocation failed!");
     node->ident = id;
+    node->val = createNumberNode(0, INT_TYPE);
     return node;
 
 }
 
 SYM_TABLE_NODE *addToSymbolTable(SYM_TABLE_NODE *root, SYM_TABLE_NODE *new){
+    if (new == NULL)
+        return root;
     new->next = root;
     return new;
 }
@@ -186,10 +217,14 @@ ARG_TABLE_NODE *addToArgTable(ARG_TABLE_NODE *root, char *new){
 }
 
 AST_NODE *linkSymbolTable(SYM_TABLE_NODE *table, AST_NODE *node){
+    if (node == NULL){
+        freeSymbolTable(table);
+        return NULL;
+    }
     node->table = table;
-    AST_NODE *traversal = node->table->value;
+    SYM_TABLE_NODE *traversal = node->table;
     while (traversal != NULL){
-        traversal->parent = node;
+        traversal->value->parent = node;
         traversal = traversal->next;
     }
     return node;
@@ -199,9 +234,17 @@ AST_NODE *createCondNode(AST_NODE *cond, AST_NODE *trueSec, AST_NODE *falseSec){
     AST_NODE *node;
     size_t nodeSize;
 
+    // a part that failed to parse is NULL, the cond is dropped with it
+    if (cond == NULL || trueSec == NULL || falseSec == NULL){
+        freeNode(cond);
+        freeNode(trueSec);
+        freeNode(falseSec);
+        return NULL;
+    }
+
     // allocate space (or error)
     nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    if ((node = ciLispAlloc(nodeSize, MEM_COND_NODE)) == NULL)
         yyerror("Memory allocation failed!");
 
     node->type = COND_NODE_TYPE;
@@ -216,15 +259,90 @@ AST_NODE *createCondNode(AST_NODE *cond, AST_NODE *trueSec, AST_NODE *falseSec){
     return node;
 }
 
+// Called when a loop_expr is created (see ciLisp.y).
+// loopName is the token text ("loop", "do", "sum" or "prod"); acc and init are NULL for sum and prod.
+// The loop variable and accumulator are stored as args of the body, the same way lambda params are,
+// so the bounds and init are still evaluated in the enclosing scope.
+AST_NODE *createLoopNode(char *loopName, char *var, AST_NODE *from, AST_NODE *to, char *acc, AST_NODE *init, AST_NODE *body){
+    AST_NODE *node;
+    size_t nodeSize;
+
+    if (from == NULL || to == NULL || body == NULL || (acc != NULL && init == NULL)){
+        ciLispFree(loopName);
+        ciLispFree(var);
+        ciLispFree(acc);
+        freeNode(from);
+        freeNode(to);
+        freeNode(init);
+        freeNode(body);
+        return NULL;
+    }
+
+    nodeSize = sizeof(AST_NODE);
+    if ((node = ciLispAlloc(nodeSize, MEM_LOOP_NODE)) == NULL)
+        yyerror("Memory allocation failed!");
+
+    node->type = LOOP_NODE_TYPE;
+    if (strcmp(loopName, "sum") == 0) node->data.loop.type = SUM_LOOP;
+    else if (strcmp(loopName, "prod") == 0) node->data.loop.type = PROD_LOOP;
+    else node->data.loop.type = LOOP_LOOP;
+    ciLispFree(loopName);
+
+    node->data.loop.from = from;
+    node->data.loop.to = to;
+    node->data.loop.init = init;
+    node->data.loop.body = body;
+
+    body->argTable = createArgTableNode(var);
+    if (acc != NULL) body->argTable->next = createArgTableNode(acc);
+
+    from->parent = node;
+    to->parent = node;
+    if (init != NULL) init->parent = node;
+    body->parent = node;
+
+    return node;
+}
+
+// Called when a reduce loop_expr is created (see ciLisp.y).
+// func names a two parameter lambda (acc i), looked up once per evaluation.
+AST_NODE *createReduceNode(char *func, AST_NODE *init, AST_NODE *from, AST_NODE *to){
+    AST_NODE *node;
+    size_t nodeSize;
+
+    if (init == NULL || from == NULL || to == NULL){
+        ciLispFree(func);
+        freeNode(init);
+        freeNode(from);
+        freeNode(to);
+        return NULL;
+    }
+
+    nodeSize = sizeof(AST_NODE);
+    if ((node = ciLispAlloc(nodeSize, MEM_LOOP_NODE)) == NULL)
+        yyerror("Memory allocation failed!");
+
+    node->type = LOOP_NODE_TYPE;
+    node->data.loop.type = REDUCE_LOOP;
+    node->data.loop.func = func;
+    node->data.loop.from = from;
+    node->data.loop.to = to;
+    node->data.loop.init = init;
+
+    from->parent = node;
+    to->parent = node;
+    init->parent = node;
+
+    return node;
+}
+
 // Called after execution is done on the base of the tree.
 // (see the program production in ciLisp.y)
 // Recursively frees the whole abstract syntax tree.
 // You'll need to update and expand freeNode as the project develops.
-void freeNode(AST_NODE *node)
+// freeOneNode frees a node with its children, freeNode below also frees the nodes after it.
+static void freeOneNode(AST_NODE *node)
 {
-    if (!node)
-        return;
-
     if (node->type == FUNC_NODE_TYPE)
     {
         // Recursive calls to free child nodes
@@ -233,37 +351,158 @@ void freeNode(AST_NODE *node)
         // Free up identifier string if necessary
         if (node->data.function.oper == CUSTOM_OPER)
         {
-            free(node->data.function.ident);
+            ciLispFree(node->data.function.ident);
         }
     }
 
-    if (node->table != NULL){
-        SYM_TABLE_NODE *current = node->table;
-        while(current != NULL){
-            SYM_TABLE_NODE *temp = current;
-            current = current->next;
-            free(temp);
-        }
-    }
+    freeSymbolTable(node->table);
 
     if(node->type == SYM_NODE_TYPE){
-        free(node->data.symbol.identifier);
+        ciLispFree(node->data.symbol.identifier);
     }
 
-    if (node->argTable != NULL){
-        ARG_TABLE_NODE *current = node->argTable;
-        while (current != NULL){
-            ARG_TABLE_NODE *temp = current;
-            current = current->next;
-            free(temp);
-        }
+    if (node->type == COND_NODE_TYPE){
+        freeNode(node->data.condition.cond);
+        freeNode(node->data.condition.nodeTrue);
+        freeNode(node->data.condition.nodeFalse);
+    }
+
+    if (node->type == LOOP_NODE_TYPE){
+        freeNode(node->data.loop.from);
+        freeNode(node->data.loop.to);
+        freeNode(node->data.loop.init);
+        freeNode(node->data.loop.body);
+        ciLispFree(node->data.loop.func);
+    }
+
+    if (node->type == BIND_NODE_TYPE){
+        freeNode(node->data.bind.args);
+        freeNode(node->data.bind.body);
+        ciLispFree(node->data.bind.func);
+    }
+
+    freeArgTable(node->argTable);
+
+    ciLispFree(node);
+}
+
+// Frees node and every node after it in its operand list, the list is walked instead of recursed
+// so long operand lists don't use stack.
+void freeNode(AST_NODE *node)
+{
+    while (node != NULL){
+        AST_NODE *next = node->next;
+        freeOneNode(node);
+        node = next;
+    }
+}
+
+// Frees a let section along with the identifiers and values bound in it.
+void freeSymbolTable(SYM_TABLE_NODE *table)
+{
+    while (table != NULL){
+        SYM_TABLE_NODE *temp = table;
+        table = table->next;
+        ciLispFree(temp->id);
+        freeNode(temp->value);
+        ciLispFree(temp);
     }
+}
+
+// Frees a lambda/loop arg table along with the parameter names and bound value nodes.
+void freeArgTable(ARG_TABLE_NODE *table)
+{
+    while (table != NULL){
+        ARG_TABLE_NODE *temp = table;
+        table = table->next;
+        ciLispFree(temp->ident);
+        freeNode(temp->val);
+        ciLispFree(temp);
+    }
+}
+
+// Called by the program production (see ciLisp.y) with every parsed top-level s_expr.
+// Defaults to evalProgram; ciLispCompile swaps in a handler that keeps the tree.
+void (*programHandler)(AST_NODE *node) = evalProgram;
+
+// Evaluates and prints a top-level s_expr, then frees it.
+void evalProgram(AST_NODE *node)
+{
+    RET_VAL result;
+    if (node->argTable != NULL)
+        yyerror("ERROR: a lambda has to be bound with let before it can be called");
+    else {
+        if (tryEval(node, &result))
+            printRetVal(result);
+        printEvalReport();
+    }
+    freeNode(node);
+}
+
+// Where evalError unwinds to, NULL outside of tryEval.
+static jmp_buf *evalRecovery;
+
+// Budget of the top-level expression being evaluated, eval counts a step per node.
+static EVAL_BUDGET evalBudget;
+
+// Lambda calls recurse on the C stack, a call that would take it below stackFloor is stopped like an
+// expression over budget instead of overflowing it. The floor follows the size of the evaluating
+// thread's stack, so ulimit -s and thread stacks of any size are respected.
+static uintptr_t evalStackFloor;
+
+// --eval-report line for the last top-level expression.
+void printEvalReport(void)
+{
+    if (evalReport)
+        printf("Eval: %lu steps, %.3lf ms\n", evalBudget.steps, 1000 * budgetSeconds(&evalBudget));
+}
+
+// The step being counted when the budget ran out is not taken.
+static _Noreturn void budgetError(void)
+{
+    char message[128];
+    int length = snprintf(message, sizeof(message), "%s exceeded, stopped after %lu steps",
+                          budgetExhausted(&evalBudget), evalBudget.steps - 1);
+    if (evalBudget.timed)
+        snprintf(message + length, sizeof(message) - length, ", %.3lf ms", 1000 * budgetSeconds(&evalBudget));
+    evalError("%s", message);
+}
+
+// Evaluates node, returns false instead if an error was raised with evalError while doing so.
+// Scratch memory taken by the failed evaluation is released; the tree is left for the caller to free.
+bool tryEval(AST_NODE *node, RET_VAL *result)
+{
+    jmp_buf recovery;
+    jmp_buf *outer = evalRecovery;
+    SCRATCH_MARK mark = scratchMark();
 
-    if (node->next != NULL){
-        freeNode(node->next);
+    if (outer == NULL){
+        startBudget(&evalBudget);
+        evalStackFloor = stackFloor(&recovery);
     }
+    evalRecovery = &recovery;
+    if (setjmp(recovery) != 0){
+        scratchRelease(mark);
+        scratchTrim();
+        evalRecovery = outer;
+        return false;
+    }
+    *result = eval(node);
+    scratchTrim();
+    evalRecovery = outer;
+    return true;
+}
 
-    free(node);
+// Reports an error in the expression being evaluated and abandons it.
+// format has at most one %s, filled with name. Exits if there is no tryEval to return to.
+_Noreturn void evalError(const char *format, const char *name)
+{
+    printf("ERROR: ");
+    printf(format, name);
+    printf("\n");
+    if (evalRecovery == NULL)
+        exit(1);
+    longjmp(*evalRecovery, 1);
 }
 
 // Evaluates an AST_NODE.
@@ -275,6 +514,9 @@ RET_VAL eval(AST_NODE *node)
     if (!node)
         return (RET_VAL){INT_TYPE, NAN};
 
+    if (++evalBudget.steps >= evalBudget.nextCheck && !budgetLeft(&evalBudget))
+        budgetError();
+
     RET_VAL result = {INT_TYPE, NAN}; // see NUM_AST_NODE, because RET_VAL is just an alternative name for it.
 
     // TODO complete the switch. done
@@ -294,9 +536,15 @@ RET_VAL eval(AST_NODE *node)
         case COND_NODE_TYPE:
             result = evalCondNode(&node->data.condition);
             break;
+        case LOOP_NODE_TYPE:
+            result = evalLoopNode(node);
+            break;
+        case BIND_NODE_TYPE:
+            result = evalBindNode(node);
+            break;
 
         default:
-            yyerror("Invalid AST_NODE_TYPE, probably invalid writes somewhere!");
+            evalError("Invalid AST_NODE_TYPE, probably invalid writes somewhere!", NULL);
     }
 
     return result;
@@ -325,218 +573,226 @@ RET_VAL evalSymNode(SYM_AST_NODE *symNode, AST_NODE *node){
 }
 
 
-RET_VAL evalFuncNode(AST_NODE *node)
+// Applies a single operand builtin to an already evaluated operand.
+// Shared by evalFuncNode and compiled programs (see ciLispProgram.c) so both agree on values and types.
+RET_VAL applyUnary(OPER_TYPE oper, RET_VAL op)
 {
-    if (!node)
-        return (RET_VAL){INT_TYPE, NAN};
-
-    FUNC_AST_NODE *funcNode = &(node->data.function);
-
-    RET_VAL result = {INT_TYPE, NAN};
-
-    // TODO populate result with the result of running the function on its operands.
-    // SEE: AST_NODE, AST_NODE_TYPE, FUNC_AST_NODE
-    AST_NODE *traversal = funcNode->opList;
-    double op1, op2;
-    switch (funcNode->oper){
+    RET_VAL result = op;
+    switch (oper){
         case NEG_OPER:
-            if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            result = eval(traversal);
             result.value.dval *= -1;
             break;
-
         case ABS_OPER:
-            if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            result = eval(traversal);
-            result.value.dval = fabs(result.value.dval);
+            result.value.dval = fabs(op.value.dval);
             break;
-
         case EXP_OPER:
-            if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            result = eval(funcNode->opList);
+            result.type = DOUBLE_TYPE;
+            result.value.dval = mathExp(op.value.dval);
             break;
-
         case SQRT_OPER:
-            if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            result = eval(traversal);
             result.type = DOUBLE_TYPE;
-            result.value.dval = sqrt(result.value.dval);
+            result.value.dval = sqrt(op.value.dval);
+            break;
+        case LOG_OPER:
+            result.type = DOUBLE_TYPE;
+            result.value.dval = mathLog(op.value.dval);
+            break;
+        case EXP2_OPER:
+            result.value.dval = mathExp2(op.value.dval);
+            break;
+        case CBRT_OPER:
+            result.type = DOUBLE_TYPE;
+            result.value.dval = mathCbrt(op.value.dval);
+            break;
+        default:
+            result.value.dval = NAN;
             break;
+    }
+    return result;
+}
 
-        case ADD_OPER:
-            result.value.dval = 0;
-            result.type = INT_TYPE;
-            while (traversal != NULL){
-                if (traversal->type == NUM_NODE_TYPE && traversal->data.number.type == DOUBLE_TYPE){
-                    result.type = DOUBLE_TYPE;
-                }
-                result.value.dval += eval(traversal).value.dval;
-                traversal = traversal->next;
-            }
+// Applies a lambda's declared return type to a result, int truncates the value.
+RET_VAL applyReturnType(NUM_TYPE type, RET_VAL val)
+{
+    switch (type){
+        case INT_TYPE:
+            val.type = INT_TYPE;
+            val.value.dval = trunc(val.value.dval);
+            break;
+        case DOUBLE_TYPE:
+            val.type = DOUBLE_TYPE;
+            break;
+        case NO_TYPE:
             break;
+    }
+    return val;
+}
 
+// Declared return type of a let lambda, func is the lambda body as returned by lookup.
+NUM_TYPE lambdaReturnType(AST_NODE *func)
+{
+    // lambdas without a parent are top-level lambdas or defined ones
+    SYM_TABLE_NODE *table = func->parent == NULL ? globalTable : func->parent->table;
+    for (SYM_TABLE_NODE *entry = table; entry != NULL; entry = entry->next){
+        if (entry->value == func)
+            return entry->val_type;
+    }
+    return NO_TYPE;
+}
+
+// Applies a two operand builtin, or folds the next operand into the running result of an n-ary one.
+// Shared by evalFuncNode and compiled programs (see ciLispProgram.c) so both agree on values and types.
+RET_VAL applyBinary(OPER_TYPE oper, RET_VAL op1, RET_VAL op2)
+{
+    RET_VAL result;
+    result.type = (op1.type == DOUBLE_TYPE || op2.type == DOUBLE_TYPE) ? DOUBLE_TYPE : INT_TYPE;
+    double a = op1.value.dval;
+    double b = op2.value.dval;
+    switch (oper){
+        case ADD_OPER:
+            result.value.dval = a + b;
+            break;
         case SUB_OPER:
-            result.value.dval = eval(traversal).value.dval;
-            result.type = INT_TYPE;
-            while (traversal != NULL){
-                if (traversal->type == NUM_NODE_TYPE && traversal->data.number.type == DOUBLE_TYPE){
-                    result.type = DOUBLE_TYPE;
-                }
-                traversal = traversal->next;
-                result.value.dval -= eval(traversal).value.dval;
-                traversal = traversal->next;
-            }
+            result.value.dval = a - b;
             break;
-
         case MULT_OPER:
-            result.type = INT_TYPE;
-            if (traversal->type == NUM_NODE_TYPE && traversal->data.number.type == DOUBLE_TYPE){
-                result.type = DOUBLE_TYPE;
-            }
-            result.value.dval = eval(traversal).value.dval;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function mult\n");
-                exit(1);
-            } else{
-                traversal = traversal->next;
-                while (traversal != NULL){
-                    if (traversal->type == NUM_NODE_TYPE && traversal->data.number.type == DOUBLE_TYPE){
-                        result.type = DOUBLE_TYPE;
-                    }
-                    result.value.dval *= eval(traversal).value.dval;
-                    traversal = traversal->next;
-                }
-            }
+            result.value.dval = a * b;
             break;
-
         case DIV_OPER:
             result.type = DOUBLE_TYPE;
-            result.value.dval = eval(traversal).value.dval;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function div\n");
-                exit(1);
-            } else{
-                traversal = traversal->next;
-                while (traversal != NULL){
-                    result.value.dval /= eval(traversal).value.dval;
-                    traversal = traversal->next;
-                }
-            }
+            result.value.dval = a / b;
             break;
-
         case REMAINDER_OPER:
+            result.value.dval = remainder(a, b);
+            break;
+        case POW_OPER:
+            result.value.dval = mathPow(a, b);
+            break;
+        case MAX_OPER:
+            result.value.dval = fmax(a, b);
+            result.type = ((a >= b && op1.type == DOUBLE_TYPE) || (b >= a && op2.type == DOUBLE_TYPE)) ? DOUBLE_TYPE : INT_TYPE;
+            break;
+        case MIN_OPER:
+            result.value.dval = fmin(a, b);
+            result.type = ((a <= b && op1.type == DOUBLE_TYPE) || (b <= a && op2.type == DOUBLE_TYPE)) ? DOUBLE_TYPE : INT_TYPE;
+            break;
+        case HYPOT_OPER:
+            result.type = DOUBLE_TYPE;
+            result.value.dval = mathHypot(a, b);
+            break;
+        case LESS_OPER:
             result.type = INT_TYPE;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function remainder\n");
-                exit(1);
-            } else{
-                if (traversal->type == NUM_NODE_TYPE && traversal->data.number.type == DOUBLE_TYPE){
-                    result.type = DOUBLE_TYPE;
-                }
-                op1 = eval(traversal).value.dval;
-                traversal = traversal->next;
-                if (traversal->type == NUM_NODE_TYPE && traversal->data.number.type == DOUBLE_TYPE){
-                    result.type = DOUBLE_TYPE;
-                }
-                op2 = eval(traversal).value.dval;
-                result.value.dval = remainder(op1, op2);
-                if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            }
+            result.value.dval = a < b;
             break;
+        case GREATER_OPER:
+            result.type = INT_TYPE;
+            result.value.dval = a > b;
+            break;
+        case EQUAL_OPER:
+            result.type = INT_TYPE;
+            result.value.dval = a == b;
+            break;
+        default:
+            result.value.dval = NAN;
+            break;
+    }
+    return result;
+}
+
+// Reads a number typed by the user for read. Kept out of evalFuncNode so the input buffer isn't
+// part of its stack frame, which every level of a recursive lambda call has a copy of.
+__attribute__((noinline)) static RET_VAL readNumber(void)
+{
+    RET_VAL result;
+    char temp[BUFSIZ];
+    printf("read: ");
+    scanf("%s", temp);
+    getchar();
+    if (strchr(temp, '.') != NULL) result.type = DOUBLE_TYPE;
+    else result.type = INT_TYPE;
+    result.value.dval = strtod(temp, NULL);
+    return result;
+}
+
+RET_VAL evalFuncNode(AST_NODE *node)
+{
+    if (!node)
+        return (RET_VAL){INT_TYPE, NAN};
+
+    FUNC_AST_NODE *funcNode = &(node->data.function);
+
+    RET_VAL result = {INT_TYPE, NAN};
 
+    // TODO populate result with the result of running the function on its operands.
+    // SEE: AST_NODE, AST_NODE_TYPE, FUNC_AST_NODE
+    AST_NODE *traversal = funcNode->opList;
+    switch (funcNode->oper){
+        case NEG_OPER:
+        case ABS_OPER:
+        case EXP_OPER:
+        case SQRT_OPER:
         case LOG_OPER:
+        case EXP2_OPER:
+        case CBRT_OPER:
+            if (traversal == NULL)
+                evalError("Too few parameters for function %s", funcNames[funcNode->oper]);
             if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            result = eval(traversal);
-            result.type = DOUBLE_TYPE;
-            result.value.dval = log(result.value.dval);
+            result = applyUnary(funcNode->oper, eval(traversal));
             break;
 
-        case POW_OPER:
+        case ADD_OPER:
+            result.value.dval = 0;
             result.type = INT_TYPE;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function pow\n");
-                exit(1);
-            } else{
-                if (traversal->type == NUM_NODE_TYPE && traversal->data.number.type == DOUBLE_TYPE){
-                    result.type = DOUBLE_TYPE;
-                }
-                op1 = eval(traversal).value.dval;
+            while (traversal != NULL){
+                result = applyBinary(ADD_OPER, result, eval(traversal));
                 traversal = traversal->next;
-                if (traversal->type == NUM_NODE_TYPE && traversal->data.number.type == DOUBLE_TYPE){
-                    result.type = DOUBLE_TYPE;
-                }
-                op2 = eval(traversal).value.dval;
-                result.value.dval = pow(op1, op2);
-                if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
             }
             break;
 
-        case MAX_OPER:
-            result.type = INT_TYPE;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function max\n");
-                exit(1);
-            } else{
-                RET_VAL ret = eval(traversal);
-                op1 = ret.value.dval;
-                NUM_TYPE type1 = ret.type;
+        case SUB_OPER:
+            if (traversal == NULL)
+                evalError("Too few parameters for function %s", funcNames[funcNode->oper]);
+            result = eval(traversal);
+            traversal = traversal->next;
+            while (traversal != NULL){
+                result = applyBinary(SUB_OPER, result, eval(traversal));
                 traversal = traversal->next;
-                ret = eval(traversal);
-                op2 = ret.value.dval;
-                NUM_TYPE type2 = ret.type;
-                result.value.dval = fmax(op1, op2);
-                if ((op1 >= op2 && type1 == DOUBLE_TYPE) || (op2 >= op1 && type2 == DOUBLE_TYPE)) result.type = DOUBLE_TYPE;
-                if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
             }
             break;
 
+        case MULT_OPER:
+        case DIV_OPER:
+        case MAX_OPER:
         case MIN_OPER:
-            result.type = INT_TYPE;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function min\n");
-                exit(1);
-            } else{
-                RET_VAL ret = eval(traversal);
-                op1 = ret.value.dval;
-                NUM_TYPE type1 = ret.type;
+        case HYPOT_OPER:
+            if (traversal == NULL || traversal->next == NULL)
+                evalError("Too few parameters for function %s", funcNames[funcNode->oper]);
+            result = eval(traversal);
+            traversal = traversal->next;
+            while (traversal != NULL){
+                result = applyBinary(funcNode->oper, result, eval(traversal));
                 traversal = traversal->next;
-                ret = eval(traversal);
-                op2 = ret.value.dval;
-                NUM_TYPE type2 = ret.type;
-                result.value.dval = fmin(op1, op2);
-                if ((op1 <= op2 && type1 == DOUBLE_TYPE) || (op2 <= op1 && type2 == DOUBLE_TYPE)) result.type = DOUBLE_TYPE;
-                if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
             }
             break;
 
-        case EXP2_OPER:
-            if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            result = eval(traversal);
-            result.value.dval = exp2(result.value.dval);
-            break;
-
-        case CBRT_OPER:
+        case REMAINDER_OPER:
+        case POW_OPER:
+        case LESS_OPER:
+        case GREATER_OPER:
+        case EQUAL_OPER: {
+            if (traversal == NULL || traversal->next == NULL)
+                evalError("Too few parameters for function %s", funcNames[funcNode->oper]);
+            RET_VAL op1 = eval(traversal);
+            traversal = traversal->next;
+            RET_VAL op2 = eval(traversal);
+            result = applyBinary(funcNode->oper, op1, op2);
             if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            result = eval(traversal);
-            result.type = DOUBLE_TYPE;
-            result.value.dval = cbrt(result.value.dval);
-            break;
-
-        case HYPOT_OPER:
-            result.type = DOUBLE_TYPE;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function hypot\n");
-                exit(1);
-            } else{
-                op1 = eval(traversal).value.dval;
-                traversal = traversal->next;
-                op2 = eval(traversal).value.dval;
-                result.value.dval = hypot(op1, op2);
-                if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            }
             break;
+        }
 
         case PRINT_OPER:{
+            if (traversal == NULL)
+                evalError("Too few parameters for function %s", funcNames[funcNode->oper]);
             AST_NODE *temp = funcNode->opList;
             RET_VAL tem;
             while (temp != NULL){
@@ -551,92 +807,58 @@ RET_VAL evalFuncNode(AST_NODE *node)
                 break;
             }
 
-        case READ_OPER: {
-            char temp[BUFSIZ];
-            printf("read: ");
-            scanf("%s", temp);
-            getchar();
-            if (strchr(temp, '.') != NULL) result.type = DOUBLE_TYPE;
-            else result.type = INT_TYPE;
-            result.value.dval = strtod(temp, NULL);
-            node->type = NUM_NODE_TYPE;
-            node->data.number.type = result.type;
-            node->data.number.value.dval = result.value.dval;
-            break;
-        }
-
-        case RAND_OPER:
-            result.type = DOUBLE_TYPE;
-            result.value.dval = ((double) rand() / RAND_MAX);
-            node->type = NUM_NODE_TYPE;
-            node->data.number.type = result.type;
-            node->data.number.value.dval = result.value.dval;
+        case READ_OPER:
+            result = readNumber();
             break;
 
-        case LESS_OPER:
+        case MEMSTATS_OPER:
+            printMemStats(stdout);
             result.type = INT_TYPE;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function less\n");
-                exit(1);
-            } else{
-                op1 = eval(traversal).value.dval;
-                traversal = traversal->next;
-                op2 = eval(traversal).value.dval;
-                if (op1 < op2) result.value.dval = 1;
-                else result.value.dval = 0;
-                if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            }
+            result.value.dval = ciLispMemStats().liveBytes;
             break;
 
-        case GREATER_OPER:
+        case CACHESTATS_OPER:
+            printCacheStats(stdout);
             result.type = INT_TYPE;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function greater\n");
-                exit(1);
-            } else{
-                op1 = eval(traversal).value.dval;
-                traversal = traversal->next;
-                op2 = eval(traversal).value.dval;
-                if (op1 > op2) result.value.dval = 1;
-                else result.value.dval = 0;
-                if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            }
+            result.value.dval = resultCacheStats().hits;
             break;
 
-        case EQUAL_OPER:
-            result.type = INT_TYPE;
-            if (traversal->next == NULL){
-                yyerror("ERROR: Too few parameters for function equal\n");
-                exit(1);
-            } else{
-                op1 = eval(traversal).value.dval;
-                traversal = traversal->next;
-                op2 = eval(traversal).value.dval;
-                if (op1 == op2) result.value.dval = 1;
-                else result.value.dval = 0;
-                if (traversal->next != NULL) printf("WARNING: Too many parameters for func %s\n", funcNames[funcNode->oper]);
-            }
+        case RAND_OPER:
+            result.type = DOUBLE_TYPE;
+            result.value.dval = ((double) rand() / RAND_MAX);
             break;
 
         case CUSTOM_OPER: {
+            // args are evaluated under the caller's bindings, then swapped into the lambda's arg table.
+            // the list keeps the caller's values so recursive calls can put them back afterwards.
+            SCRATCH_MARK mark = scratchMark();
+            if ((uintptr_t) &mark < evalStackFloor)
+                evalError("Recursion too deep in %s, stopped", funcNode->ident);
             RET_VAL_LIST *list = evalForArg(traversal);
             RET_VAL_LIST *root = list;
             AST_NODE *func = lookup(funcNode->ident, node);
             ARG_TABLE_NODE *currentArg = func->argTable;
             while (list != NULL && currentArg != NULL){
-                currentArg->val = &list->val;
+                RET_VAL old = currentArg->val->data.number;
+                currentArg->val->data.number = list->val;
+                list->val = old;
                 currentArg = currentArg->next;
                 list = list->next;
             }
-            if(currentArg != NULL){
-                yyerror("ERROR: NOT ENOUGH PARAMETERS FOR CUSTOM FUNCTION");
-                exit(1);
-            }
+            if(currentArg != NULL)
+                evalError("NOT ENOUGH PARAMETERS FOR CUSTOM FUNCTION %s", funcNode->ident);
             if (list != NULL){
                 printf("WARNING!: Too many parameters for function! Will only use the first in the list!");
             }
-            freeRetValList(root);
-            result = eval(func);
+            result = applyReturnType(lambdaReturnType(func), eval(func));
+            list = root;
+            currentArg = func->argTable;
+            while (list != NULL && currentArg != NULL){
+                currentArg->val->data.number = list->val;
+                currentArg = currentArg->next;
+                list = list->next;
+            }
+            scratchRelease(mark);
             break;
         }
     }
@@ -648,8 +870,22 @@ char *operNames[] = {"negate", "absolute value of", "base e exponent of",
                   "power of", "maximum of", "minimum of", "base 2 exponent of",
                   "cube root of", "hypotenuse of", "reading", "randing", "printing"};
 
+// Prints a call as ( name op1 with op2 ... ), name is the builtin's description or the lambda's name.
+static void printCall(const char *name, AST_NODE *opList)
+{
+    printf("( %s ", name);
+    printFunc(opList);
+
+    if (opList != NULL && opList->next != NULL) {
+        printf("with ");
+        printFunc(opList->next);
+    } else printf(")");
+}
+
 void printFunc(AST_NODE *node){
     double num = 0;
+    if (node == NULL)
+        return;
     switch (node->type){
         case NUM_NODE_TYPE:
             num = node->data.number.value.dval;
@@ -663,16 +899,21 @@ void printFunc(AST_NODE *node){
             }
             //if (node->next != NULL) printFunc(node->next);
             break;
-        case FUNC_NODE_TYPE:
-            printf("( %s ", operNames[node->data.function.oper]);
-            printFunc(node->data.function.opList);
-
-            if (node->data.function.opList->next != NULL) {
-                printf("with ");
-                printFunc(node->data.function.opList->next);
-            } else printf(")");
+        case FUNC_NODE_TYPE: {
+            FUNC_AST_NODE *funcNode = &node->data.function;
+            if (funcNode->oper == CUSTOM_OPER)
+                printCall(funcNode->ident, funcNode->opList);
+            else if (funcNode->oper < sizeof(operNames) / sizeof(*operNames))
+                printCall(operNames[funcNode->oper], funcNode->opList);
+            else
+                printCall(funcNames[funcNode->oper], funcNode->opList);
+            break;
+        }
+        case BIND_NODE_TYPE:
+            printCall(node->data.bind.func, node->data.bind.args);
             break;
-        case SYM_NODE_TYPE: {
+        case SYM_NODE_TYPE:
+        case LOOP_NODE_TYPE: {
             RET_VAL temp = eval(node);
             switch (temp.type) {
                 case INT_TYPE:
@@ -703,45 +944,58 @@ void printRetVal(RET_VAL val)
     }
 }
 
+// The value a let or global entry stands for, a declared type is applied to number literals.
+static AST_NODE *symbolValue(SYM_TABLE_NODE *entry, char *search){
+    if (entry->value->type == NUM_NODE_TYPE) {
+        if (entry->val_type != NO_TYPE) {
+            if (entry->val_type == INT_TYPE &&
+                entry->value->data.number.type == DOUBLE_TYPE) {
+                printf("WARNING: Precision loss in variable %s\n", search);
+            }
+            entry->value->data.number.type = entry->val_type;
+        }
+    }
+    return entry->value;
+}
+
 AST_NODE *lookup(char *search, AST_NODE *origin){
     while (origin != NULL) {
         SYM_TABLE_NODE *currentTable = origin->table;
         ARG_TABLE_NODE *currentArgTable = origin->argTable;
         while (currentTable != NULL) {
             if (strcmp(currentTable->id, search) == 0) {
-                if (currentTable->value->type == NUM_NODE_TYPE) {
-                    if (currentTable->val_type != NO_TYPE) {
-                        if (currentTable->val_type == INT_TYPE &&
-                            currentTable->value->data.number.type == DOUBLE_TYPE) {
-                            printf("WARNING: Precision loss in variable %s\n", search);
-                        }
-                        currentTable->value->data.number.type = currentTable->val_type;
-                    }
-                }
-                return currentTable->value;
+                return symbolValue(currentTable, search);
             }
             currentTable = currentTable->next;
 
         }
         while (currentArgTable != NULL){
             if (strcmp(search, currentArgTable->ident) == 0){
-                AST_NODE temp = *origin;
-                temp.type = NUM_NODE_TYPE;
-                temp.data.number = *currentArgTable->val;
-                return &temp;
+                return currentArgTable->val;
             }
             currentArgTable = currentArgTable->next;
         }
         origin = origin->parent;
     }
 
-    yyerror("Invalid symbol given!\n");
-    exit(1);
+    // the global environment (define) comes last
+    SYM_TABLE_NODE *global = lookupGlobal(search);
+    if (global != NULL)
+        return symbolValue(global, search);
+
+    evalError("Invalid symbol %s given!", search);
 }
 
-AST_NODE *addToS_exprList(AST_NODE *new, AST_NODE *base){
-    new->next = base;
-    return new;
+// Appends an operand to the end of the list, operands that failed to parse (NULL) are left out.
+S_EXPR_LIST addToS_exprList(S_EXPR_LIST list, AST_NODE *new){
+    if (new == NULL)
+        return list;
+    if (list.tail == NULL)
+        list.head = new;
+    else
+        list.tail->next = new;
+    list.tail = new;
+    return list;
 }
 
 RET_VAL evalCondNode(COND_AST_NODE *condNode){
@@ -752,17 +1006,25 @@ RET_VAL evalCondNode(COND_AST_NODE *condNode){
     return result;
 }
 
+// The list lives in eval scratch memory, the caller releases it with scratchRelease.
 RET_VAL_LIST *evalForArg(AST_NODE *current){
+    if (current == NULL)
+        return NULL;
     RET_VAL_LIST *root;
-    root = calloc(sizeof(RET_VAL_LIST), 1);
+    if ((root = scratchAlloc(sizeof(RET_VAL_LIST))) == NULL)
+        evalError("Memory allocation failed!", NULL);
     RET_VAL tem = eval(current);
     root->val = tem;
+    root->next = NULL;
     current = current->next;
     RET_VAL_LIST *cur = root;
     while (current != NULL){
-        RET_VAL_LIST *value = calloc(sizeof(RET_VAL_LIST), 1);
+        RET_VAL_LIST *value;
+        if ((value = scratchAlloc(sizeof(RET_VAL_LIST))) == NULL)
+            evalError("Memory allocation failed!", NULL);
         tem = eval(current);
         value->val = tem;
+        value->next = NULL;
         cur->next = value;
         cur = cur->next;
         current = current->next;
@@ -771,14 +1033,113 @@ RET_VAL_LIST *evalForArg(AST_NODE *current){
     return root;
 }
 
-void freeRetValList(RET_VAL_LIST *root){
-    while (root != NULL){
-        RET_VAL_LIST *temp = root;
-        root = root->next;
-        free(temp);
+
+
+
+
+
+// Runs a loop_expr as a native C loop.
+// The loop variable and accumulator are rebound in place each iteration, no arg lists are built.
+// Previous bindings are saved and put back so a loop inside a recursive lambda stays correct.
+// Loop counters are longs, bounds have to be finite and below LOOP_BOUND_LIMIT so the counter can't overflow.
+
+static long loopBound(RET_VAL bound)
+{
+    if (!(fabs(bound.value.dval) < LOOP_BOUND_LIMIT)){
+        char text[32];
+        snprintf(text, sizeof(text), "%g", bound.value.dval);
+        evalError("Loop bound %s is not a finite number in range", text);
     }
+    return (long) bound.value.dval;
 }
 
+RET_VAL evalLoopNode(AST_NODE *node){
+    LOOP_AST_NODE *loopNode = &node->data.loop;
+    RET_VAL result = {INT_TYPE, {NAN}};
+
+    long from = loopBound(eval(loopNode->from));
+    long to = loopBound(eval(loopNode->to));
+
+    if (loopNode->type == REDUCE_LOOP){
+        result = eval(loopNode->init);
+        AST_NODE *func = lookup(loopNode->func, node);
+        ARG_TABLE_NODE *accArg = func->argTable;
+        if (accArg == NULL || accArg->next == NULL || accArg->next->next != NULL)
+            evalError("reduce needs a lambda with two parameters (acc i), %s has a different count", loopNode->func);
+        ARG_TABLE_NODE *varArg = accArg->next;
+        RET_VAL oldAcc = accArg->val->data.number;
+        RET_VAL oldVar = varArg->val->data.number;
+        varArg->val->data.number.type = INT_TYPE;
+        NUM_TYPE returnType = lambdaReturnType(func);
+        for (long i = from; i <= to; i++){
+            accArg->val->data.number = result;
+            varArg->val->data.number.value.dval = i;
+            result = applyReturnType(returnType, eval(func));
+        }
+        accArg->val->data.number = oldAcc;
+        varArg->val->data.number = oldVar;
+        return result;
+    }
 
+    ARG_TABLE_NODE *varArg = loopNode->body->argTable;
+    ARG_TABLE_NODE *accArg = varArg->next;
+    RET_VAL oldVar = varArg->val->data.number;
+    RET_VAL oldAcc = oldVar;
+    RET_VAL current;
 
+    switch (loopNode->type){
+        case SUM_LOOP:
+            result.value.dval = 0;
+            break;
+        case PROD_LOOP:
+            result.value.dval = 1;
+            break;
+        default:
+            result = eval(loopNode->init);
+            oldAcc = accArg->val->data.number;
+            break;
+    }
 
+    varArg->val->data.number.type = INT_TYPE;
+    for (long i = from; i <= to; i++){
+        varArg->val->data.number.value.dval = i;
+        switch (loopNode->type){
+            case SUM_LOOP:
+                current = eval(loopNode->body);
+                if (current.type == DOUBLE_TYPE) result.type = DOUBLE_TYPE;
+                result.value.dval += current.value.dval;
+                break;
+            case PROD_LOOP:
+                current = eval(loopNode->body);
+                if (current.type == DOUBLE_TYPE) result.type = DOUBLE_TYPE;
+                result.value.dval *= current.value.dval;
+                break;
+            default:
+                accArg->val->data.number = result;
+                result = eval(loopNode->body);
+                break;
+        }
+    }
+
+    varArg->val->data.number = oldVar;
+    if (accArg != NULL) accArg->val->data.number = oldAcc;
+    return result;
+}
+
+// Evaluates an inlined lambda call (see ciLispInline.c).
+// Every arg is evaluated before any param is bound, the same as CUSTOM_OPER. The body is a private
+// copy that calls no lambdas, so nothing else can see the params while they are bound.
+RET_VAL evalBindNode(AST_NODE *node){
+    BIND_AST_NODE *bind = &node->data.bind;
+    RET_VAL values[INLINE_MAX_PARAMS];
+    int count = 0;
+
+    for (AST_NODE *arg = bind->args; arg != NULL; arg = arg->next)
+        values[count++] = eval(arg);
+
+    count = 0;
+    for (ARG_TABLE_NODE *param = bind->body->argTable; param != NULL; param = param->next)
+        param->val->data.number = values[count++];
+
+    return applyReturnType(bind->type, eval(bind->body));
+}
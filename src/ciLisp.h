@@ -6,9 +6,14 @@
 #include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
 
 #include "ciLispParser.h"
+#include "ciLispApi.h"
 
 int yyparse(void);
 
@@ -41,11 +46,15 @@ typedef enum oper {
     EQUAL_OPER,
     LESS_OPER,
     GREATER_OPER,
+    MEMSTATS_OPER,
+    CACHESTATS_OPER,
     CUSTOM_OPER =255
 } OPER_TYPE;
 
 OPER_TYPE resolveFunc(char *);
 
+extern char *funcNames[];
+
 // Types of Abstract Syntax Tree nodes.
 // Initially, there are only numbers and functions.
 // You will expand this enum as you build the project.
@@ -53,7 +62,9 @@ typedef enum {
     NUM_NODE_TYPE,
     FUNC_NODE_TYPE,
     SYM_NODE_TYPE,
-    COND_NODE_TYPE
+    COND_NODE_TYPE,
+    LOOP_NODE_TYPE,
+    BIND_NODE_TYPE
 } AST_NODE_TYPE;
 
 // Types of numeric values
@@ -68,6 +79,14 @@ typedef enum {
     LAMBDA_TYPE
 } SYMBOL_TYPE;
 
+// Kinds of native loops
+typedef enum {
+    LOOP_LOOP,   // (loop (i from to) (acc init) body) -> acc
+    SUM_LOOP,    // (sum (i from to) body)
+    PROD_LOOP,   // (prod (i from to) body)
+    REDUCE_LOOP  // (reduce f init from to) -> f(...f(f(init, from), from + 1)..., to)
+} LOOP_TYPE;
+
 //Node to store a condition
 typedef struct{
     struct ast_node *cond;
@@ -75,6 +94,28 @@ typedef struct{
     struct ast_node *nodeFalse;
 } COND_AST_NODE;
 
+//Node to store a counted loop
+//The loop variable (and accumulator) live in body->argTable and are rebound in place every iteration
+typedef struct{
+    LOOP_TYPE type;
+    struct ast_node *from;
+    struct ast_node *to;
+    struct ast_node *init;
+    struct ast_node *body;
+    char *func; // only needed for reduce
+} LOOP_AST_NODE;
+
+//Node to store an inlined lambda call (see ciLispInline.c)
+//args are evaluated in the caller's scope, then bound to the params in body->argTable
+#define INLINE_MAX_PARAMS 8
+
+typedef struct{
+    struct ast_node *args;
+    struct ast_node *body; // a copy of the lambda body
+    NUM_TYPE type;         // declared return type of the lambda
+    char *func;            // name of the lambda, print shows the call
+} BIND_AST_NODE;
+
 //Node to store a symbol
 typedef struct{
     char *identifier;
@@ -90,7 +131,7 @@ typedef struct {
 
 typedef struct arg_table_node {
     char *ident;
-    NUM_AST_NODE *val;
+    struct ast_node *val; // number node holding the currently bound value
     struct arg_table_node *next;
 } ARG_TABLE_NODE;
 
@@ -119,6 +160,8 @@ typedef struct ast_node {
         FUNC_AST_NODE function;
         SYM_AST_NODE symbol;
         COND_AST_NODE condition;
+        LOOP_AST_NODE loop;
+        BIND_AST_NODE bind;
     } data;
     struct ast_node *next;
 } AST_NODE;
@@ -129,6 +172,7 @@ typedef struct sym_table_node{
     NUM_TYPE val_type;
     char *id;
     AST_NODE *value;
+    bool impure; // global definitions only: the value calls read, rand or print, maybe through other globals
     struct sym_table_node *next;
 } SYM_TABLE_NODE;
 
@@ -137,34 +181,236 @@ typedef struct ret_val_list{
     struct ret_val_list *next;
 } RET_VAL_LIST;
 
+// Kinds of allocations tracked by the counted allocator (see ciLispMem.c).
+// The AST node kinds line up with AST_NODE_TYPE so nodes are counted by type.
+// must be in sync with memKindNames
+typedef enum {
+    MEM_NUM_NODE = NUM_NODE_TYPE,
+    MEM_FUNC_NODE = FUNC_NODE_TYPE,
+    MEM_SYM_NODE = SYM_NODE_TYPE,
+    MEM_COND_NODE = COND_NODE_TYPE,
+    MEM_LOOP_NODE = LOOP_NODE_TYPE,
+    MEM_BIND_NODE = BIND_NODE_TYPE,
+    MEM_SYM_TABLE,
+    MEM_ARG_TABLE,
+    MEM_STRING,
+    MEM_SCRATCH,
+    MEM_PROGRAM,
+    MEM_BUFFER,
+    MEM_CACHE,
+    MEM_KIND_COUNT
+} MEM_KIND;
+
+typedef struct {
+    size_t liveBytes;
+    size_t peakBytes;
+    size_t liveKindBytes[MEM_KIND_COUNT];
+    size_t liveCount[MEM_KIND_COUNT];
+    size_t totalCount[MEM_KIND_COUNT];
+} MEM_STATS;
+
+extern bool memStrict;
+
+void *ciLispAlloc(size_t size, MEM_KIND kind);
+void *ciLispRealloc(void *ptr, size_t size);
+void ciLispRetype(void *ptr, MEM_KIND kind);
+void ciLispFree(void *ptr);
+char *ciLispStrdup(const char *s);
+MEM_STATS ciLispMemStats(void);
+void printMemStats(FILE *out);
+void printMemReport(void);
+size_t expressionLiveBytes(void);
+ptrdiff_t ciLispThreadBytes(void);
+void ciLispKeep(ptrdiff_t bytes);
+void checkMemStrict(size_t liveBefore);
+void checkLineMemStrict(ptrdiff_t leaked);
+
+typedef struct {
+    struct scratch_chunk *chunk;
+    size_t used;
+} SCRATCH_MARK;
+
+void *scratchAlloc(size_t size);
+SCRATCH_MARK scratchMark(void);
+void scratchRelease(SCRATCH_MARK mark);
+void scratchTrim(void);
+
 AST_NODE *createNumberNode(double value, NUM_TYPE type);
 
 AST_NODE *createFunctionNode(char *funcName, AST_NODE *opList);
 
 void freeNode(AST_NODE *node);
+void freeSymbolTable(SYM_TABLE_NODE *table);
+void freeArgTable(ARG_TABLE_NODE *table);
 
 RET_VAL eval(AST_NODE *node);
+bool tryEval(AST_NODE *node, RET_VAL *result);
+_Noreturn void evalError(const char *format, const char *name);
 RET_VAL evalNumNode(NUM_AST_NODE *numNode);
 RET_VAL evalFuncNode(AST_NODE *node);
 RET_VAL evalSymNode(SYM_AST_NODE *symNode, AST_NODE *node);
 RET_VAL evalCondNode(COND_AST_NODE *condNode);
+RET_VAL evalLoopNode(AST_NODE *node);
+RET_VAL evalBindNode(AST_NODE *node);
+RET_VAL applyUnary(OPER_TYPE oper, RET_VAL op);
+RET_VAL applyBinary(OPER_TYPE oper, RET_VAL op1, RET_VAL op2);
+RET_VAL applyReturnType(NUM_TYPE type, RET_VAL val);
+
+extern bool fastMath;
+double mathExp(double x);
+double mathExp2(double x);
+double mathLog(double x);
+double mathCbrt(double x);
+double mathPow(double x, double y);
+double mathHypot(double x, double y);
+bool mathUnaryBatch(OPER_TYPE oper, const double *in, double *out, size_t n);
+bool mathBinaryBatch(OPER_TYPE oper, const double *x, const double *y, double *out, size_t n);
+NUM_TYPE lambdaReturnType(AST_NODE *func);
+
+// Steps and time taken by the expression being evaluated (see ciLispBudget.c).
+typedef struct {
+    unsigned long steps;
+    unsigned long nextCheck; // budgetLeft is due once steps gets here
+    double start;
+    bool timed; // start was read, only done for a deadline or --eval-report
+} EVAL_BUDGET;
+
+extern unsigned long stepBudget;
+extern double timeBudget;
+extern bool evalReport;
+void startBudget(EVAL_BUDGET *budget);
+bool budgetLeft(EVAL_BUDGET *budget);
+double budgetSeconds(const EVAL_BUDGET *budget);
+const char *budgetExhausted(const EVAL_BUDGET *budget);
+void printEvalReport(void);
+uintptr_t stackFloor(const void *frame);
+
+extern bool inlining;
+AST_NODE *inlineCalls(AST_NODE *root);
+AST_NODE *inlineDefinition(AST_NODE *value);
 
 AST_NODE *lookup(char *search, AST_NODE *origin);
 AST_NODE *createSymbolNode(char *symbol);
 SYM_TABLE_NODE *createSymbolTableNode(AST_NODE *value, char *identifier, char *type);
 SYM_TABLE_NODE *addToSymbolTable(SYM_TABLE_NODE *root, SYM_TABLE_NODE *new);
 AST_NODE *linkSymbolTable(SYM_TABLE_NODE *table, AST_NODE *node);
-AST_NODE *addToS_exprList(AST_NODE *new, AST_NODE *base);
+S_EXPR_LIST addToS_exprList(S_EXPR_LIST list, AST_NODE *new);
 AST_NODE *createCondNode(AST_NODE *cond, AST_NODE *trueSec, AST_NODE *falseSec);
 ARG_TABLE_NODE *createArgTableNode(char *id);
+AST_NODE *createLambdaNode(ARG_TABLE_NODE *arg, AST_NODE *body);
 ARG_TABLE_NODE *addToArgTable(ARG_TABLE_NODE *root, char *new);
 SYM_TABLE_NODE *createLambdaSymbolTableNode(AST_NODE *value, char *id, char *type, ARG_TABLE_NODE *arg);
 RET_VAL_LIST *evalForArg(AST_NODE *current);
+AST_NODE *createLoopNode(char *loopName, char *var, AST_NODE *from, AST_NODE *to, char *acc, AST_NODE *init, AST_NODE *body);
+AST_NODE *createReduceNode(char *func, AST_NODE *init, AST_NODE *from, AST_NODE *to);
+
+
+// Instructions of a compiled program (see ciLispProgram.c).
+// must be in sync with the switch in runProgram
+// Largest magnitude of a loop bound, the tree evaluator and compiled programs both reject anything else
+// (infinities and nan included) so a loop always ends and its counter can't overflow.
+#define LOOP_BOUND_LIMIT 0x1p62
+
+typedef enum {
+    OP_CONST,      // push value
+    OP_INPUT,      // push input a
+    OP_LOAD,       // push slot b of the frame a static links up
+    OP_STORE,      // pop into slot b of the current frame
+    OP_UNARY,      // apply builtin a to the top value
+    OP_BINARY,     // pop, apply builtin a to the new top and the popped value
+    OP_TRUNC,      // truncate the top value, a loop bound, to an int, fails unless it is below LOOP_BOUND_LIMIT
+    OP_CAST,       // apply the declared return type a to the top value
+    OP_JUMP,       // continue at a
+    OP_JUMP_FALSE, // pop, continue at a if the value was 0
+    OP_LOOP_TEST,  // continue at c if slot a > slot b
+    OP_INC,        // add 1 to slot a
+    OP_CALL,       // call function a with the top b values as args, its definition is c static links up
+    OP_RETURN,     // leave the current function with the top value
+    OP_RAND,       // push a random double
+    OP_PRINT,      // print the top b values, keep the last one
+    OP_HALT        // stop, the top value is the result
+} CODE_OP;
+
+typedef struct {
+    CODE_OP op;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+    RET_VAL value;
+} CILISP_INSTR;
+
+// Each lambda reachable from the program gets a function, function 0 is the program itself.
+typedef struct {
+    int32_t entry;    // first instruction
+    int32_t nArgs;
+    int32_t nSlots;   // args, let variables and loop variables
+    int32_t maxDepth; // operand stack needed on top of the slots
+    int32_t level;    // lambda nesting depth of the definition, 0 for the program
+} CILISP_FUNCTION;
+
+// View of a compiled program, everything it points to lives in block and is addressed by index.
+struct ciLisp_program {
+    const CILISP_INSTR *code;
+    int codeLength;
+    const CILISP_FUNCTION *functions;
+    int functionCount;
+    const char *inputNames; // inputCount NUL terminated names back to back
+    int inputCount;
+    void *block;
+    size_t mappedSize; // block is an image mapped by ciLispLoadImage if not 0
+};
+
+CILISP_PROGRAM *compileProgram(AST_NODE *root, const char *const *inputNames, int inputCount);
+CILISP_STATUS runProgram(const CILISP_PROGRAM *program, const double *inputs, RET_VAL *result);
+bool validProgram(const CILISP_PROGRAM *program);
+void unmapImage(CILISP_PROGRAM *program);
+
+extern void (*programHandler)(AST_NODE *node);
+void evalProgram(AST_NODE *node);
+int parseLine(const char *line);
+
+// A scanned token and its semantic value, see ciLispCache.c.
+typedef struct {
+    int type;
+    YYSTYPE value;
+} TOKEN;
+
+typedef struct {
+    TOKEN *tokens;
+    int count;
+    int capacity;
+    int next; // next token yylex hands to the parser
+} TOKEN_LIST;
+
+int scanToken(void);
+void scanLine(const char *line, TOKEN_LIST *tokens);
+void appendToken(TOKEN_LIST *tokens, int type, YYSTYPE value);
+extern bool syntaxError;
+extern bool quitRequested;
+int parseTokens(TOKEN_LIST *tokens);
+void freeTokens(TOKEN_LIST *tokens);
+bool tokensCall(const TOKEN_LIST *tokens, OPER_TYPE oper);
+void evalLine(const char *line);
+char *cacheKey(const TOKEN_LIST *tokens, size_t *length);
+void evalCachedProgram(AST_NODE *node, char *key, size_t length);
+
+void setResultCacheCapacity(size_t capacity);
+void flushResultCache(void);
+CILISP_CACHE_STATS resultCacheStats(void);
+void printCacheStats(FILE *out);
+
+void runPipeline(FILE *in);
 
+extern SYM_TABLE_NODE *globalTable;
+SYM_TABLE_NODE *lookupGlobal(const char *name);
+void defineSymbols(SYM_TABLE_NODE *table);
+void beginLine(void);
+void endLine(void);
+bool tokensDefine(const TOKEN_LIST *tokens);
+bool tokensImpure(const TOKEN_LIST *tokens);
 
 void printFunc(AST_NODE *node);
 void printRetVal(RET_VAL val);
-void freeRetValList(RET_VAL_LIST *root);
 
 
 #endif
@@ -2,31 +2,65 @@
     #include "ciLisp.h"
 %}
 
+%code requires {
+    // The operands of a call while they are parsed. The tail is kept so every operand is appended in O(1).
+    typedef struct s_expr_list {
+        struct ast_node *head;
+        struct ast_node *tail;
+    } S_EXPR_LIST;
+}
+
 %union {
     double dval;
     char *sval;
     struct ast_node *astNode;
     struct sym_table_node *symTbNode;
     struct arg_table_node *argTbNode;
+    S_EXPR_LIST exprList;
 };
 
-%token <sval> FUNC SYMBOL TYPE
+%token <sval> FUNC SYMBOL TYPE LOOP ACCUM
 %token <dval> INT DOUBLE
-%token LPAREN RPAREN EOL QUIT LET COND LAMBDA
+%token LPAREN RPAREN EOL QUIT LET COND LAMBDA REDUCE DEFINE
 
-%type <astNode> s_expr f_expr number s_expr_list
-%type <symTbNode> let_elem let_section let_list
+%type <astNode> s_expr f_expr number loop_expr
+%type <exprList> s_expr_list
+%type <symTbNode> let_elem let_section let_list define_list
 %type <argTbNode> arg_list
 
+%destructor { freeNode($$); } <astNode>
+%destructor { freeNode($$.head); } <exprList>
+%destructor { ciLispFree($$); } <sval>
+%destructor { freeSymbolTable($$); } <symTbNode>
+%destructor { freeArgTable($$); } <argTbNode>
+
 %%
 
 program:
     s_expr EOL {
         fprintf(stderr, "yacc: program ::= s_expr EOL\n");
-        if ($1) {
-            printRetVal(eval($1));
+        if ($1 && !syntaxError) {
+            programHandler(inlineCalls($1));
+        } else {
             freeNode($1);
         }
+    }
+    | LPAREN LAMBDA LPAREN arg_list RPAREN s_expr RPAREN EOL {
+        fprintf(stderr, "yacc: program ::= LPAREN LAMBDA LPAREN arg_list RPAREN s_expr RPAREN EOL\n");
+        if ($6 && !syntaxError) {
+            programHandler(createLambdaNode($4, inlineCalls($6)));
+        } else {
+            freeNode($6);
+            freeArgTable($4);
+        }
+    }
+    | LPAREN define_list RPAREN EOL {
+        fprintf(stderr, "yacc: program ::= LPAREN define_list RPAREN EOL\n");
+        if (!syntaxError) {
+            defineSymbols($2);
+        } else {
+            freeSymbolTable($2);
+        }
     };
 
 s_expr:
@@ -41,9 +75,15 @@ s_expr:
     | f_expr {
         $$ = $1;
     }
+    | loop_expr {
+        $$ = $1;
+    }
     | QUIT {
         fprintf(stderr, "yacc: s_expr ::= QUIT\n");
-        exit(EXIT_SUCCESS);
+        // the parser belongs to the library, so quit only stops the line, the REPL driver exits
+        quitRequested = true;
+        $$ = NULL;
+        YYABORT;
     }
     | LPAREN let_section s_expr RPAREN {
         fprintf(stderr, "yacc: s_expr ::= let\n");
@@ -56,15 +96,17 @@ s_expr:
     | error {
         fprintf(stderr, "yacc: s_expr ::= error\n");
         yyerror("unexpected token");
+        syntaxError = true;
         $$ = NULL;
     };
 
+// left recursive, so bison reduces after every operand instead of stacking the whole list
 s_expr_list:
-    s_expr s_expr_list{
+    s_expr_list s_expr{
         $$ = addToS_exprList($1, $2);
     }
     | s_expr{
-        $$ = $1;
+        $$ = addToS_exprList((S_EXPR_LIST){NULL, NULL}, $1);
     };
 
 let_elem:
@@ -99,12 +141,34 @@ let_list:
         $$ = addToSymbolTable($1, $2);
     };
 
+define_list:
+    DEFINE let_elem {
+        $$ = $2;
+    }
+    | define_list let_elem {
+        $$ = addToSymbolTable($1, $2);
+    };
+
 let_section:
     LPAREN let_list RPAREN{
         $$ = $2;
     };
 
 
+loop_expr:
+    LPAREN LOOP LPAREN SYMBOL s_expr s_expr RPAREN LPAREN SYMBOL s_expr RPAREN s_expr RPAREN {
+        fprintf(stderr, "yacc: loop_expr ::= LPAREN LOOP LPAREN SYMBOL s_expr s_expr RPAREN LPAREN SYMBOL s_expr RPAREN s_expr RPAREN\n");
+        $$ = createLoopNode($2, $4, $5, $6, $9, $10, $12);
+    }
+    | LPAREN ACCUM LPAREN SYMBOL s_expr s_expr RPAREN s_expr RPAREN {
+        fprintf(stderr, "yacc: loop_expr ::= LPAREN ACCUM LPAREN SYMBOL s_expr s_expr RPAREN s_expr RPAREN\n");
+        $$ = createLoopNode($2, $4, $5, $6, NULL, NULL, $8);
+    }
+    | LPAREN REDUCE SYMBOL s_expr s_expr s_expr RPAREN {
+        fprintf(stderr, "yacc: loop_expr ::= LPAREN REDUCE SYMBOL s_expr s_expr s_expr RPAREN\n");
+        $$ = createReduceNode($3, $4, $5, $6);
+    };
+
 number:
     INT {
         fprintf(stderr, "yacc: number ::= INT\n");
@@ -122,11 +186,11 @@ f_expr:
     }
     | LPAREN FUNC s_expr_list RPAREN {
         fprintf(stderr, "yacc: s_expr ::= LPAREN FUNC s_expr_list RPAREN\n");
-        $$ = createFunctionNode($2, $3);
+        $$ = createFunctionNode($2, $3.head);
     }
     | LPAREN SYMBOL s_expr_list RPAREN{
         fprintf(stderr, "yacc: s_expr ::= LPAREN SYMBOL s_expr_list RPAREN\n");
-        $$ = createFunctionNode($2, $3);
+        $$ = createFunctionNode($2, $3.head);
     };
 
 %%
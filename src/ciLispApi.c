@@ -0,0 +1,253 @@
+#include "ciLisp.h"
+#include <pthread.h>
+
+// Public entry points of libcilisp (see ciLispApi.h).
+// The scanner and parser keep global state, so parsing is serialized; evaluating compiled
+// programs needs no locking at all.
+
+static pthread_mutex_t parseMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static AST_NODE *capturedProgram;
+
+// programHandler used while compiling, keeps the parsed tree instead of evaluating it.
+static void captureProgram(AST_NODE *node)
+{
+    freeNode(capturedProgram);
+    capturedProgram = node;
+}
+
+// The grammar ends every program with EOL, returns line itself if it already ends in one or
+// a counted copy with the newline added.
+static char *terminatedLine(const char *line)
+{
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n')
+        return (char *) line;
+
+    char *copy;
+    if ((copy = ciLispAlloc(len + 2, MEM_STRING)) == NULL)
+        return NULL;
+    memcpy(copy, line, len);
+    copy[len] = '\n';
+    return copy;
+}
+
+// Compiles a top-level (lambda (params) body) with the params as the inputs, in order.
+static CILISP_PROGRAM *compileLambda(AST_NODE *lambda, int inputCount)
+{
+    if (inputCount != 0){
+        yyerror("ERROR: input names cannot be given for a lambda, its params are the inputs");
+        return NULL;
+    }
+
+    int count = 0;
+    for (ARG_TABLE_NODE *arg = lambda->argTable; arg != NULL; arg = arg->next)
+        count++;
+
+    const char **names;
+    if ((names = ciLispAlloc(count * sizeof(char *), MEM_PROGRAM)) == NULL)
+        return NULL;
+    count = 0;
+    for (ARG_TABLE_NODE *arg = lambda->argTable; arg != NULL; arg = arg->next)
+        names[count++] = arg->ident;
+
+    // detached while compiling so the params resolve as inputs instead of as args of a function
+    ARG_TABLE_NODE *params = lambda->argTable;
+    lambda->argTable = NULL;
+    CILISP_PROGRAM *program = compileProgram(lambda, names, count);
+    lambda->argTable = params;
+
+    ciLispFree(names);
+    return program;
+}
+
+CILISP_PROGRAM *ciLispCompile(const char *source, const char *const *inputNames, int inputCount, CILISP_STATUS *status)
+{
+    CILISP_STATUS ignored;
+    if (status == NULL)
+        status = &ignored;
+
+    // a program is a single line to the scanner
+    char *line;
+    size_t len = strlen(source);
+    if ((line = ciLispAlloc(len + 2, MEM_STRING)) == NULL){
+        *status = CILISP_COMPILE_ERROR;
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i++)
+        line[i] = (source[i] == '\n' || source[i] == '\r') ? ' ' : source[i];
+    line[len] = '\n';
+
+    pthread_mutex_lock(&parseMutex);
+
+    programHandler = captureProgram;
+    parseLine(line);
+    programHandler = evalProgram;
+    AST_NODE *ast = capturedProgram;
+    capturedProgram = NULL;
+    ciLispFree(line);
+
+    CILISP_PROGRAM *program = NULL;
+    if (ast == NULL){
+        *status = CILISP_PARSE_ERROR;
+    } else {
+        if (ast->argTable != NULL)
+            program = compileLambda(ast, inputCount);
+        else
+            program = compileProgram(ast, inputNames, inputCount);
+        *status = program == NULL ? CILISP_COMPILE_ERROR : CILISP_OK;
+        freeNode(ast);
+    }
+
+    pthread_mutex_unlock(&parseMutex);
+    return program;
+}
+
+CILISP_STATUS ciLispEval(const CILISP_PROGRAM *program, const double *inputs, CILISP_VALUE *result)
+{
+    RET_VAL val;
+    CILISP_STATUS status = runProgram(program, inputs, &val);
+    if (status == CILISP_OK){
+        result->isDouble = val.type == DOUBLE_TYPE;
+        result->value = val.value.dval;
+    }
+    return status;
+}
+
+int ciLispInputIndex(const CILISP_PROGRAM *program, const char *name)
+{
+    const char *current = program->inputNames;
+    for (int i = 0; i < program->inputCount; i++){
+        if (strcmp(current, name) == 0)
+            return i;
+        current += strlen(current) + 1;
+    }
+    return -1;
+}
+
+int ciLispInputCount(const CILISP_PROGRAM *program)
+{
+    return program->inputCount;
+}
+
+void ciLispFreeProgram(CILISP_PROGRAM *program)
+{
+    if (program == NULL)
+        return;
+    if (program->mappedSize != 0)
+        unmapImage(program);
+    else
+        ciLispFree(program->block);
+    ciLispFree(program);
+}
+
+const char *ciLispStatusMessage(CILISP_STATUS status)
+{
+    switch (status){
+        case CILISP_OK:
+            return "ok";
+        case CILISP_PARSE_ERROR:
+            return "parse error";
+        case CILISP_COMPILE_ERROR:
+            return "compile error";
+        case CILISP_STACK_OVERFLOW:
+            return "stack overflow";
+        case CILISP_INPUT_ERROR:
+            return "input error";
+        case CILISP_IMAGE_ERROR:
+            return "image error";
+        case CILISP_BUDGET_EXCEEDED:
+            return "budget exceeded";
+        case CILISP_RANGE_ERROR:
+            return "loop bound out of range";
+    }
+    return "unknown status";
+}
+
+bool ciLispRunLine(const char *line)
+{
+    size_t liveBefore = expressionLiveBytes();
+    char *source = terminatedLine(line);
+    if (source == NULL)
+        return true;
+
+    pthread_mutex_lock(&parseMutex);
+    evalLine(source);
+    bool quit = quitRequested;
+    pthread_mutex_unlock(&parseMutex);
+
+    if (source != line)
+        ciLispFree(source);
+    checkMemStrict(liveBefore);
+    return !quit;
+}
+
+void ciLispRunPipeline(FILE *in)
+{
+    pthread_mutex_lock(&parseMutex);
+    runPipeline(in);
+    pthread_mutex_unlock(&parseMutex);
+}
+
+void ciLispSetResultCache(size_t capacity)
+{
+    pthread_mutex_lock(&parseMutex);
+    setResultCacheCapacity(capacity);
+    pthread_mutex_unlock(&parseMutex);
+}
+
+CILISP_CACHE_STATS ciLispResultCacheStats(void)
+{
+    pthread_mutex_lock(&parseMutex);
+    CILISP_CACHE_STATS stats = resultCacheStats();
+    pthread_mutex_unlock(&parseMutex);
+    return stats;
+}
+
+void ciLispSetInlining(bool enabled)
+{
+    pthread_mutex_lock(&parseMutex);
+    inlining = enabled;
+    pthread_mutex_unlock(&parseMutex);
+}
+
+// Cached results were computed in the other mode, so the cache is emptied.
+void ciLispSetFastMath(bool enabled)
+{
+    pthread_mutex_lock(&parseMutex);
+    fastMath = enabled;
+    flushResultCache();
+    pthread_mutex_unlock(&parseMutex);
+}
+
+CILISP_STATUS ciLispMathBatch(const char *func, const double *x, const double *y, double *out, size_t n)
+{
+    OPER_TYPE oper = resolveFunc((char *) func);
+    bool applied = y == NULL ? mathUnaryBatch(oper, x, out, n) : mathBinaryBatch(oper, x, y, out, n);
+    return applied ? CILISP_OK : CILISP_COMPILE_ERROR;
+}
+
+void ciLispSetStrictMem(bool strict)
+{
+    memStrict = strict;
+}
+
+void ciLispSetBudget(unsigned long steps, double seconds)
+{
+    pthread_mutex_lock(&parseMutex);
+    stepBudget = steps;
+    timeBudget = seconds;
+    pthread_mutex_unlock(&parseMutex);
+}
+
+void ciLispSetEvalReport(bool enabled)
+{
+    pthread_mutex_lock(&parseMutex);
+    evalReport = enabled;
+    pthread_mutex_unlock(&parseMutex);
+}
+
+void ciLispEnableMemReport(void)
+{
+    atexit(printMemReport);
+}
@@ -0,0 +1,110 @@
+#ifndef __cilisp_api_h_
+#define __cilisp_api_h_
+
+// Embedding interface of libcilisp.
+// Source is compiled once into a CILISP_PROGRAM, which can then be evaluated any number of times
+// with different inputs, from any number of threads, without lexing, parsing or allocating.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum {
+    CILISP_OK,
+    CILISP_PARSE_ERROR,
+    CILISP_COMPILE_ERROR,
+    CILISP_STACK_OVERFLOW,
+    CILISP_INPUT_ERROR,
+    CILISP_IMAGE_ERROR,
+    CILISP_BUDGET_EXCEEDED,
+    CILISP_RANGE_ERROR
+} CILISP_STATUS;
+
+// Result of evaluating a program, mirrors the Integer/Double results printed by the REPL.
+typedef struct {
+    bool isDouble;
+    double value;
+} CILISP_VALUE;
+
+typedef struct ciLisp_program CILISP_PROGRAM;
+
+// Compiles a single s_expr. Symbols that are not bound inside the expression are looked up in
+// inputNames and become inputs of the program, in that order. Returns NULL and sets status on failure.
+// The source can also be a (lambda (params) body), then the params are the inputs and inputNames must be empty.
+CILISP_PROGRAM *ciLispCompile(const char *source, const char *const *inputNames, int inputCount, CILISP_STATUS *status);
+
+// Evaluates a compiled program. inputs holds one value per input name, bound as doubles.
+// Safe to call concurrently on the same program. A loop bound that is not a finite number in range
+// gives CILISP_RANGE_ERROR.
+CILISP_STATUS ciLispEval(const CILISP_PROGRAM *program, const double *inputs, CILISP_VALUE *result);
+
+// Returns the position of name in the program's inputs or -1 if it is not an input.
+int ciLispInputIndex(const CILISP_PROGRAM *program, const char *name);
+int ciLispInputCount(const CILISP_PROGRAM *program);
+
+void ciLispFreeProgram(CILISP_PROGRAM *program);
+
+// Writes a compiled program to path as an image, which ciLispLoadImage maps back in any later run.
+// The file is replaced with a rename, so processes that have the old image mapped keep running.
+CILISP_STATUS ciLispSaveImage(const CILISP_PROGRAM *program, const char *path);
+// Maps an image read only and runs it in place: nothing is parsed, compiled or copied, and
+// processes loading the same image share its pages. Images written by another version of
+// libcilisp, on another ABI, or damaged are rejected with CILISP_IMAGE_ERROR.
+// Free the program with ciLispFreeProgram like a compiled one.
+CILISP_PROGRAM *ciLispLoadImage(const char *path, CILISP_STATUS *status);
+
+const char *ciLispStatusMessage(CILISP_STATUS status);
+
+typedef struct {
+    char delimiter;  // ',' for CSV, '\t' for TSV
+    bool header;     // the first row names the columns, which are matched to inputs by name
+    int threads;     // worker threads, 0 uses one per processor
+    long badRows;    // set by ciLispRunCsv, rows with a missing or malformed field or an evaluation error
+} CILISP_CSV_OPTIONS;
+
+// Streams delimited rows from in through program and writes one result per row to out, in row order.
+// Without a header column i is input i. Rows are spread over worker threads in blocks.
+// Returns CILISP_INPUT_ERROR if the header lacks an input or a line is longer than a block.
+CILISP_STATUS ciLispRunCsv(const CILISP_PROGRAM *program, FILE *in, FILE *out, CILISP_CSV_OPTIONS *options);
+
+// Fast math trades the bit exact libm results of exp, exp2, log, cbrt and hypot for polynomial
+// approximations within 3 ULP. pow is libm's in both modes. Off by default; set it before
+// evaluating, not while programs run.
+void ciLispSetFastMath(bool enabled);
+// Applies the builtin func to n values at once, or n pairs for pow and hypot (y is NULL for the one
+// operand builtins). out may be x or y. Works for exp, exp2, log, sqrt, cbrt, pow and hypot,
+// other names give CILISP_COMPILE_ERROR.
+CILISP_STATUS ciLispMathBatch(const char *func, const double *x, const double *y, double *out, size_t n);
+
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t entries;
+    size_t capacity;
+    size_t evictions;
+} CILISP_CACHE_STATS;
+
+// REPL support used by the cilisp executable.
+// Parses, evaluates and prints the expression on the line. Returns false if the line asked to quit,
+// in which case nothing on it is evaluated; the library never exits the process itself.
+bool ciLispRunLine(const char *line);
+// Runs every line of in like ciLispRunLine, parsing ahead on the calling thread while an evaluator
+// thread evaluates and prints in line order. Stops at the end of in or at quit.
+void ciLispRunPipeline(FILE *in);
+// Keeps the results of up to capacity pure lines for ciLispRunLine, least recently used ones are
+// dropped first. 0 disables and empties the cache.
+void ciLispSetResultCache(size_t capacity);
+CILISP_CACHE_STATS ciLispResultCacheStats(void);
+void ciLispSetStrictMem(bool strict);
+// Limits each top-level expression to steps evaluation steps and seconds of wall-clock time, 0 lifts
+// a limit. The REPL counts a step per node evaluated and stops an expression over budget with an
+// error, freeing it, then goes on with the next line. ciLispEval counts calls and loop iterations
+// and returns CILISP_BUDGET_EXCEEDED. Set it before evaluating, not while programs run.
+void ciLispSetBudget(unsigned long steps, double seconds);
+// Prints the steps and time each top-level expression took after its result.
+void ciLispSetEvalReport(bool enabled);
+// Inlining of small lambdas at their call sites, on by default.
+void ciLispSetInlining(bool enabled);
+void ciLispEnableMemReport(void);
+
+#endif
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE // pthread_getattr_np
+#include "ciLisp.h"
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+// Per expression evaluation budgets.
+// Every top-level expression may take at most stepBudget steps and timeBudget seconds of wall-clock
+// time, 0 is no limit. eval counts a step for every node it evaluates, runProgram for every call
+// and loop iteration, so both count in a plain integer and only look further when the count
+// reaches nextCheck: at the step budget, or every BUDGET_CLOCK_STEPS steps to read the clock while
+// a deadline is set. Without budgets nextCheck is never reached.
+
+#define BUDGET_CLOCK_STEPS 4096
+
+// Stack kept free below the deepest lambda call for evalError, printf and the builtins it calls.
+#define STACK_MARGIN (256 << 10)
+
+unsigned long stepBudget;
+double timeBudget;
+bool evalReport;
+
+static double monotonicSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void scheduleCheck(EVAL_BUDGET *budget)
+{
+    budget->nextCheck = ULONG_MAX;
+    if (timeBudget > 0)
+        budget->nextCheck = budget->steps + BUDGET_CLOCK_STEPS;
+    // N steps are allowed, the one after them fails
+    if (stepBudget != 0 && stepBudget < budget->nextCheck - 1)
+        budget->nextCheck = stepBudget + 1;
+}
+
+// Starts counting an expression. The clock is only read when a deadline or the report needs the time,
+// a step budget alone runs without it.
+void startBudget(EVAL_BUDGET *budget)
+{
+    budget->steps = 0;
+    budget->timed = timeBudget > 0 || evalReport;
+    budget->start = budget->timed ? monotonicSeconds() : 0;
+    scheduleCheck(budget);
+}
+
+// Called once steps reaches nextCheck, returns false if the expression is out of steps or time.
+bool budgetLeft(EVAL_BUDGET *budget)
+{
+    if (stepBudget != 0 && budget->steps > stepBudget)
+        return false;
+    if (timeBudget > 0 && budgetSeconds(budget) > timeBudget)
+        return false;
+    scheduleCheck(budget);
+    return true;
+}
+
+// Seconds since startBudget, 0 if it did not read the clock.
+double budgetSeconds(const EVAL_BUDGET *budget)
+{
+    return budget->timed ? monotonicSeconds() - budget->start : 0;
+}
+
+// Describes why budgetLeft gave up on budget, for the error message.
+const char *budgetExhausted(const EVAL_BUDGET *budget)
+{
+    return stepBudget != 0 && budget->steps > stepBudget ? "step budget" : "deadline";
+}
+
+// Lowest stack address lambda calls on the calling thread may reach, see the CUSTOM_OPER case of
+// evalFuncNode. The bounds of the thread's stack come from pthread_getattr_np, which covers the main
+// thread (sized by RLIMIT_STACK) as well as the pipeline evaluator. Where it fails the limit is taken
+// from RLIMIT_STACK below frame, an address in the caller's stack frame. Worked out once per thread.
+uintptr_t stackFloor(const void *frame)
+{
+    static _Thread_local uintptr_t floor;
+    if (floor != 0)
+        return floor;
+
+    uintptr_t here = (uintptr_t) frame;
+    void *low;
+    size_t size;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0){
+        if (pthread_attr_getstack(&attr, &low, &size) == 0 && size > STACK_MARGIN)
+            floor = (uintptr_t) low + STACK_MARGIN;
+        pthread_attr_destroy(&attr);
+    }
+    if (floor == 0){
+        struct rlimit limit;
+        size = 8 << 20; // the usual default
+        if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+            size = limit.rlim_cur;
+        size = size > 2 * STACK_MARGIN ? size - 2 * STACK_MARGIN : 0;
+        floor = here > size ? here - size : 1;
+    }
+    return floor;
+}
@@ -0,0 +1,393 @@
+#include "ciLisp.h"
+
+// Token stream between the scanner and the parser, and the result cache built on top of it.
+// A line is scanned into a TOKEN_LIST first and yylex replays that list to bison, so all tokens of
+// a line are known before it is parsed. With the cache enabled (--cache, ciLispSetResultCache) the
+// normalized token stream of a pure line is its key: when the same tokens come in again the stored
+// result is printed without parsing or evaluating anything.
+// Lines that use read, rand, print, memstats, cachestats, quit or define are never cached, nor are lines
+// whose evaluation ended in an error. In the pipelined REPL the reader builds the keys and the evaluator
+// thread looks them up, so a hit saves the evaluation but not the parse.
+
+#define CACHE_MIN_BUCKETS 16
+
+typedef struct cache_entry {
+    uint64_t hash;
+    size_t keyLength;
+    RET_VAL result;
+    struct cache_entry *chain; // next entry in the same bucket
+    struct cache_entry *newer; // LRU list, newest first
+    struct cache_entry *older;
+    char key[];                // normalized token stream, see buildKey
+} CACHE_ENTRY;
+
+static TOKEN_LIST *replayTokens;
+
+static CACHE_ENTRY **buckets;
+static size_t bucketCount;
+static CACHE_ENTRY *newest;
+static CACHE_ENTRY *oldest;
+static CILISP_CACHE_STATS cacheStats;
+
+static RET_VAL keptResult;
+static bool resultKept;
+
+static bool hasSval(int type)
+{
+    return type == FUNC || type == SYMBOL || type == TYPE || type == LOOP || type == ACCUM;
+}
+
+void appendToken(TOKEN_LIST *tokens, int type, YYSTYPE value)
+{
+    if (tokens->count == tokens->capacity){
+        int capacity = tokens->capacity == 0 ? 64 : tokens->capacity * 2;
+        TOKEN *grown;
+        if (tokens->tokens == NULL)
+            grown = ciLispAlloc(capacity * sizeof(TOKEN), MEM_BUFFER);
+        else
+            grown = ciLispRealloc(tokens->tokens, capacity * sizeof(TOKEN));
+        if (grown == NULL){
+            yyerror("Memory allocation failed!");
+            if (hasSval(type))
+                ciLispFree(value.sval);
+            return;
+        }
+        tokens->tokens = grown;
+        tokens->capacity = capacity;
+    }
+    tokens->tokens[tokens->count].type = type;
+    tokens->tokens[tokens->count].value = value;
+    tokens->count++;
+}
+
+// Frees the names the parser has not taken over and the list itself.
+void freeTokens(TOKEN_LIST *tokens)
+{
+    for (int i = 0; i < tokens->count; i++){
+        if (hasSval(tokens->tokens[i].type))
+            ciLispFree(tokens->tokens[i].value.sval);
+    }
+    ciLispFree(tokens->tokens);
+    tokens->tokens = NULL;
+    tokens->count = tokens->capacity = tokens->next = 0;
+}
+
+// The parser's token source, hands out the tokens of the list given to parseTokens.
+int yylex(void)
+{
+    if (replayTokens == NULL || replayTokens->next == replayTokens->count)
+        return 0;
+
+    TOKEN *token = &replayTokens->tokens[replayTokens->next++];
+    yylval = token->value;
+    if (hasSval(token->type))
+        token->value.sval = NULL; // the parser owns it now
+    return token->type;
+}
+
+// Set by the error production, a line with any part that failed to parse is dropped as a whole.
+bool syntaxError;
+// Set by the quit production, which abandons the line. Left for the driver to act on.
+bool quitRequested;
+
+int parseTokens(TOKEN_LIST *tokens)
+{
+    syntaxError = false;
+    quitRequested = false;
+    replayTokens = tokens;
+    tokens->next = 0;
+    int status = yyparse();
+    replayTokens = NULL;
+    return status;
+}
+
+// Scans and parses one line of source, which must end in a newline.
+// Whatever the program production parses is passed on to programHandler.
+int parseLine(const char *line)
+{
+    TOKEN_LIST tokens = {NULL, 0, 0, 0};
+    beginLine();
+    scanLine(line, &tokens);
+    int status = parseTokens(&tokens);
+    freeTokens(&tokens);
+    endLine();
+    return status;
+}
+
+// Tells if the line calls the builtin oper.
+bool tokensCall(const TOKEN_LIST *tokens, OPER_TYPE oper)
+{
+    for (int i = 0; i < tokens->count; i++){
+        if (tokens->tokens[i].type == FUNC && resolveFunc(tokens->tokens[i].value.sval) == oper)
+            return true;
+    }
+    return false;
+}
+
+// Encodes the tokens before EOL as the cache key: every token type followed by its number or name,
+// which leaves out whitespace and the spelling of numbers.
+// Returns NULL if the line is not pure (see also tokensImpure) and so must not be cached.
+static char *buildKey(const TOKEN_LIST *tokens, size_t *length)
+{
+    if (tokensImpure(tokens))
+        return NULL;
+
+    size_t size = 0;
+    for (int i = 0; i < tokens->count && tokens->tokens[i].type != EOL; i++){
+        const TOKEN *token = &tokens->tokens[i];
+        size += sizeof(short);
+        switch (token->type){
+            case QUIT:
+            case DEFINE:
+                return NULL;
+            case INT:
+            case DOUBLE:
+                size += sizeof(double);
+                break;
+            case FUNC:
+                switch (resolveFunc(token->value.sval)){
+                    case READ_OPER:
+                    case RAND_OPER:
+                    case PRINT_OPER:
+                    case MEMSTATS_OPER:
+                    case CACHESTATS_OPER:
+                        return NULL;
+                    default:
+                        break;
+                }
+                // fallthrough
+            default:
+                if (hasSval(token->type))
+                    size += strlen(token->value.sval) + 1;
+                break;
+        }
+    }
+
+    char *key;
+    if ((key = ciLispAlloc(size + 1, MEM_BUFFER)) == NULL)
+        return NULL;
+
+    char *p = key;
+    for (int i = 0; i < tokens->count && tokens->tokens[i].type != EOL; i++){
+        const TOKEN *token = &tokens->tokens[i];
+        short type = token->type;
+        memcpy(p, &type, sizeof(short));
+        p += sizeof(short);
+        if (token->type == INT || token->type == DOUBLE){
+            memcpy(p, &token->value.dval, sizeof(double));
+            p += sizeof(double);
+        } else if (hasSval(token->type)){
+            size_t len = strlen(token->value.sval) + 1;
+            memcpy(p, token->value.sval, len);
+            p += len;
+        }
+    }
+    *length = size;
+    return key;
+}
+
+// FNV-1a
+static uint64_t hashKey(const char *key, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++){
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void unlinkEntry(CACHE_ENTRY *entry)
+{
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        oldest = entry->newer;
+}
+
+static void linkNewest(CACHE_ENTRY *entry)
+{
+    entry->newer = NULL;
+    entry->older = newest;
+    if (newest != NULL)
+        newest->newer = entry;
+    newest = entry;
+    if (oldest == NULL)
+        oldest = entry;
+}
+
+static CACHE_ENTRY *findEntry(uint64_t hash, const char *key, size_t length)
+{
+    for (CACHE_ENTRY *entry = buckets[hash & (bucketCount - 1)]; entry != NULL; entry = entry->chain){
+        if (entry->hash == hash && entry->keyLength == length && memcmp(entry->key, key, length) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static void removeEntry(CACHE_ENTRY *entry)
+{
+    CACHE_ENTRY **link = &buckets[entry->hash & (bucketCount - 1)];
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+    unlinkEntry(entry);
+    ciLispFree(entry);
+    cacheStats.entries--;
+}
+
+static void insertEntry(uint64_t hash, const char *key, size_t length, RET_VAL result)
+{
+    if (cacheStats.entries == cacheStats.capacity){
+        removeEntry(oldest);
+        cacheStats.evictions++;
+    }
+
+    CACHE_ENTRY *entry;
+    if ((entry = ciLispAlloc(sizeof(CACHE_ENTRY) + length, MEM_CACHE)) == NULL)
+        return;
+    entry->hash = hash;
+    entry->keyLength = length;
+    entry->result = result;
+    memcpy(entry->key, key, length);
+
+    CACHE_ENTRY **bucket = &buckets[hash & (bucketCount - 1)];
+    entry->chain = *bucket;
+    *bucket = entry;
+    linkNewest(entry);
+    cacheStats.entries++;
+}
+
+void flushResultCache(void)
+{
+    while (oldest != NULL)
+        removeEntry(oldest);
+}
+
+// Resizes the cache to hold up to capacity results, 0 turns it off. Drops all entries.
+void setResultCacheCapacity(size_t capacity)
+{
+    flushResultCache();
+    ciLispFree(buckets);
+    buckets = NULL;
+    bucketCount = 0;
+    cacheStats.capacity = 0;
+    if (capacity == 0)
+        return;
+
+    size_t count = CACHE_MIN_BUCKETS;
+    while (count < capacity)
+        count *= 2;
+    if ((buckets = ciLispAlloc(count * sizeof(CACHE_ENTRY *), MEM_CACHE)) == NULL)
+        return;
+    bucketCount = count;
+    cacheStats.capacity = capacity;
+}
+
+CILISP_CACHE_STATS resultCacheStats(void)
+{
+    return cacheStats;
+}
+
+void printCacheStats(FILE *out)
+{
+    size_t lookups = cacheStats.hits + cacheStats.misses;
+    fprintf(out, "Cache: %zu hits, %zu misses, %.1f%% hit rate\n", cacheStats.hits, cacheStats.misses,
+            lookups == 0 ? 0.0 : 100.0 * cacheStats.hits / lookups);
+    fprintf(out, "  entries %zu of %zu, evictions %zu\n", cacheStats.entries, cacheStats.capacity,
+            cacheStats.evictions);
+}
+
+// programHandler while a cache miss is parsed, evalProgram that also keeps the result.
+static void evalAndKeep(AST_NODE *node)
+{
+    if (node->argTable != NULL){
+        evalProgram(node);
+        return;
+    }
+    if (tryEval(node, &keptResult)){
+        resultKept = true;
+        printRetVal(keptResult);
+    }
+    printEvalReport();
+    freeNode(node);
+}
+
+// Prints the cached result for key and returns true if there is one, counts a miss otherwise.
+static bool answerFromCache(uint64_t hash, const char *key, size_t length)
+{
+    CACHE_ENTRY *entry = findEntry(hash, key, length);
+    if (entry == NULL){
+        cacheStats.misses++;
+        return false;
+    }
+    cacheStats.hits++;
+    unlinkEntry(entry);
+    linkNewest(entry);
+    printRetVal(entry->result);
+    return true;
+}
+
+// Scans, parses and evaluates one line like parseLine, pure lines seen before are answered from
+// the cache instead.
+void evalLine(const char *line)
+{
+    TOKEN_LIST tokens = {NULL, 0, 0, 0};
+    beginLine();
+    scanLine(line, &tokens);
+
+    char *key;
+    size_t length;
+    if ((key = cacheKey(&tokens, &length)) == NULL){
+        parseTokens(&tokens);
+        freeTokens(&tokens);
+        endLine();
+        return;
+    }
+
+    uint64_t hash = hashKey(key, length);
+    if (!answerFromCache(hash, key, length)){
+        resultKept = false;
+        programHandler = evalAndKeep;
+        parseTokens(&tokens);
+        programHandler = evalProgram;
+        if (resultKept)
+            insertEntry(hash, key, length, keptResult);
+    }
+
+    ciLispFree(key);
+    freeTokens(&tokens);
+    endLine();
+}
+
+// The cache key of a scanned line, or NULL if the cache is off or the line can't be cached.
+// Only reads the capacity, so the pipeline's reader can build keys while the evaluator uses the cache.
+char *cacheKey(const TOKEN_LIST *tokens, size_t *length)
+{
+    return cacheStats.capacity == 0 ? NULL : buildKey(tokens, length);
+}
+
+// evalProgram through the cache for the pipelined REPL, whose reader has parsed the line already.
+// key is the line's cacheKey and is freed here. Only the evaluator thread calls this.
+void evalCachedProgram(AST_NODE *node, char *key, size_t length)
+{
+    if (key == NULL){
+        evalProgram(node);
+        return;
+    }
+
+    uint64_t hash = hashKey(key, length);
+    if (answerFromCache(hash, key, length)){
+        freeNode(node);
+    } else {
+        resultKept = false;
+        evalAndKeep(node);
+        if (resultKept)
+            insertEntry(hash, key, length, keptResult);
+    }
+    ciLispFree(key);
+}
@@ -0,0 +1,318 @@
+#include "ciLisp.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Streams a CSV or TSV file through one compiled program (see ciLispRunCsv in ciLispApi.h).
+// Input is read in large blocks of whole lines. Each block is cut into one chunk of lines per
+// worker, the workers parse and evaluate their rows into their own output buffers, and the
+// buffers are written out in chunk order, so results come out in row order.
+// Workers only read the program and write to memory handed to them, they never allocate.
+
+#define CSV_BLOCK_SIZE (8 << 20)
+#define CSV_RESULT_SIZE 32 // longest formatted result plus newline
+#define CSV_MAX_THREADS 64
+
+typedef struct {
+    const CILISP_PROGRAM *program;
+    const int *columnInput; // input each column is bound to, -1 for columns that are not used
+    int columnCount;
+    char delimiter;
+    const char *begin;      // first line of the chunk
+    const char *end;        // one past the newline of the last line
+    char *out;
+    size_t outLength;
+    double *inputs;
+    long badRows;
+} CSV_CHUNK;
+
+static const double powersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses the number spanning [p, end).
+// Plain decimals with up to 15 digits are exact in a double, so they are built from an integer
+// mantissa and one correctly rounded division. Anything else goes through strtod.
+static bool parseNumber(const char *p, const char *end, double *value)
+{
+    const char *start = p;
+    bool negative = false;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int fraction = 0;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    for (; p < end && isdigit((unsigned char) *p); p++, digits++)
+        mantissa = mantissa * 10 + (*p - '0');
+    if (p < end && *p == '.'){
+        for (p++; p < end && isdigit((unsigned char) *p); p++, digits++, fraction++)
+            mantissa = mantissa * 10 + (*p - '0');
+    }
+
+    if (p == end && digits > 0 && digits <= 15){
+        double v = (double) mantissa / powersOfTen[fraction];
+        *value = negative ? -v : v;
+        return true;
+    }
+
+    // exponents, long mantissas, inf and nan
+    char buffer[64];
+    char *stop;
+    size_t len = end - start;
+    if (len == 0 || len >= sizeof(buffer))
+        return false;
+    memcpy(buffer, start, len);
+    buffer[len] = '\0';
+    *value = strtod(buffer, &stop);
+    return stop == buffer + len;
+}
+
+// Narrows [*begin, *end) to the field without surrounding blanks and quotes.
+static void trimField(const char **begin, const char **end)
+{
+    while (*begin < *end && (**begin == ' ' || **begin == '\t' || **begin == '\r'))
+        (*begin)++;
+    while (*end > *begin && ((*end)[-1] == ' ' || (*end)[-1] == '\t' || (*end)[-1] == '\r'))
+        (*end)--;
+    if (*end - *begin >= 2 && **begin == '"' && (*end)[-1] == '"'){
+        (*begin)++;
+        (*end)--;
+    }
+}
+
+// Writes one result line to out, which has room for CSV_RESULT_SIZE bytes (see the chunk buffers
+// in ciLispRunCsv). Integers too large for %.0f to fit are written like doubles.
+static size_t formatResult(char *out, bool ok, CILISP_VALUE value)
+{
+    int length;
+    if (!ok)
+        length = snprintf(out, CSV_RESULT_SIZE, "nan\n");
+    else if (value.isDouble || fabs(value.value) >= 1e17)
+        length = snprintf(out, CSV_RESULT_SIZE, "%.17g\n", value.value);
+    else
+        length = snprintf(out, CSV_RESULT_SIZE, "%.0f\n", value.value);
+
+    // snprintf returns the length it would have needed, never count more than was written
+    if (length < 0 || length >= CSV_RESULT_SIZE)
+        length = snprintf(out, CSV_RESULT_SIZE, "nan\n");
+    return length;
+}
+
+// Parses and evaluates every line of a chunk. Runs on a worker thread.
+static void *evalChunk(void *arg)
+{
+    CSV_CHUNK *chunk = arg;
+    int inputCount = ciLispInputCount(chunk->program);
+    const char *next;
+
+    for (const char *line = chunk->begin; line < chunk->end; line = next){
+        const char *lineEnd = memchr(line, '\n', chunk->end - line);
+        next = lineEnd + 1;
+        if (lineEnd > line && lineEnd[-1] == '\r')
+            lineEnd--;
+        if (lineEnd == line)
+            continue;
+
+        int filled = 0;
+        bool ok = true;
+        const char *field = line;
+        for (int column = 0; field <= lineEnd; column++){
+            const char *fieldEnd = memchr(field, chunk->delimiter, lineEnd - field);
+            if (fieldEnd == NULL)
+                fieldEnd = lineEnd;
+
+            int input = column < chunk->columnCount ? chunk->columnInput[column] : -1;
+            if (input >= 0){
+                const char *begin = field;
+                const char *end = fieldEnd;
+                trimField(&begin, &end);
+                if (parseNumber(begin, end, &chunk->inputs[input]))
+                    filled++;
+                else
+                    ok = false;
+            }
+            field = fieldEnd + 1;
+        }
+
+        CILISP_VALUE value = {false, NAN};
+        ok = ok && filled == inputCount && ciLispEval(chunk->program, chunk->inputs, &value) == CILISP_OK;
+        if (!ok)
+            chunk->badRows++;
+        chunk->outLength += formatResult(chunk->out + chunk->outLength, ok, value);
+    }
+    return NULL;
+}
+
+// Binds the header's column names to the program's inputs. Returns the number of columns or -1
+// if an input has no column or more than one.
+static int bindHeader(const CILISP_PROGRAM *program, const char *line, const char *lineEnd, char delimiter, int **columnInput)
+{
+    int columns = 1;
+    for (const char *p = line; p < lineEnd; p++)
+        columns += *p == delimiter;
+
+    int inputCount = ciLispInputCount(program);
+    bool *inputBound;
+    if ((*columnInput = ciLispAlloc(columns * sizeof(int), MEM_BUFFER)) == NULL
+        || (inputBound = ciLispAlloc(inputCount + 1, MEM_BUFFER)) == NULL)
+        return -1;
+
+    int bound = 0;
+    const char *field = line;
+    for (int column = 0; column < columns; column++){
+        const char *fieldEnd = memchr(field, delimiter, lineEnd - field);
+        if (fieldEnd == NULL)
+            fieldEnd = lineEnd;
+        const char *begin = field;
+        const char *end = fieldEnd;
+        trimField(&begin, &end);
+
+        char name[BUFSIZ];
+        size_t len = end - begin < BUFSIZ ? end - begin : BUFSIZ - 1;
+        memcpy(name, begin, len);
+        name[len] = '\0';
+        int input = ciLispInputIndex(program, name);
+        (*columnInput)[column] = input;
+        if (input >= 0){
+            if (inputBound[input]){
+                bound = -1;
+                break;
+            }
+            inputBound[input] = true;
+            bound++;
+        }
+        field = fieldEnd + 1;
+    }
+
+    ciLispFree(inputBound);
+    if (bound < inputCount)
+        return -1;
+    return columns;
+}
+
+CILISP_STATUS ciLispRunCsv(const CILISP_PROGRAM *program, FILE *in, FILE *out, CILISP_CSV_OPTIONS *options)
+{
+    int threads = options->threads > 0 ? options->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if (threads > CSV_MAX_THREADS)
+        threads = CSV_MAX_THREADS;
+
+    int inputCount = ciLispInputCount(program);
+    CILISP_STATUS status = CILISP_OK;
+    CSV_CHUNK chunks[CSV_MAX_THREADS];
+    pthread_t workers[CSV_MAX_THREADS];
+    size_t outCapacity[CSV_MAX_THREADS] = {0};
+    int *columnInput = NULL;
+    int columnCount = inputCount;
+    bool needHeader = options->header;
+    options->badRows = 0;
+
+    char *buffer = ciLispAlloc(CSV_BLOCK_SIZE + 1, MEM_BUFFER);
+    if (buffer == NULL)
+        return CILISP_INPUT_ERROR;
+    memset(chunks, 0, sizeof(chunks));
+    for (int i = 0; i < threads; i++){
+        chunks[i].program = program;
+        chunks[i].delimiter = options->delimiter;
+        chunks[i].inputs = ciLispAlloc((inputCount + 1) * sizeof(double), MEM_BUFFER);
+    }
+
+    if (!needHeader){
+        // without a header column i is input i
+        columnInput = ciLispAlloc((inputCount + 1) * sizeof(int), MEM_BUFFER);
+        for (int i = 0; i < inputCount; i++)
+            columnInput[i] = i;
+    }
+
+    size_t length = 0;
+    bool eof = false;
+    while (!eof || length > 0){
+        if (!eof){
+            size_t n = fread(buffer + length, 1, CSV_BLOCK_SIZE - length, in);
+            length += n;
+            eof = n == 0 || feof(in);
+        }
+        if (length == 0)
+            break;
+
+        // only whole lines are handed to the workers, the rest waits for the next read
+        if (eof && buffer[length - 1] != '\n')
+            buffer[length++] = '\n';
+        size_t lineEnds = length;
+        while (lineEnds > 0 && buffer[lineEnds - 1] != '\n')
+            lineEnds--;
+        if (lineEnds == 0){
+            if (length == CSV_BLOCK_SIZE){
+                status = CILISP_INPUT_ERROR;
+                break;
+            }
+            continue;
+        }
+        char *start = buffer;
+        char *usable = buffer + lineEnds;
+
+        if (needHeader){
+            char *headerEnd = memchr(start, '\n', usable - start);
+            char *lineEnd = headerEnd > start && headerEnd[-1] == '\r' ? headerEnd - 1 : headerEnd;
+            if ((columnCount = bindHeader(program, start, lineEnd, options->delimiter, &columnInput)) < 0){
+                status = CILISP_INPUT_ERROR;
+                break;
+            }
+            fprintf(out, "result\n");
+            start = headerEnd + 1;
+            needHeader = false;
+        }
+
+        // cut the block at line ends into one chunk per worker
+        for (int i = 0; i < threads; i++){
+            CSV_CHUNK *chunk = &chunks[i];
+            chunk->columnInput = columnInput;
+            chunk->columnCount = columnCount;
+            chunk->begin = i == 0 ? start : chunks[i - 1].end;
+            if (i == threads - 1){
+                chunk->end = usable;
+            } else {
+                char *cut = start + (usable - start) * (i + 1) / threads;
+                if (cut < chunk->begin)
+                    cut = (char *) chunk->begin;
+                char *newline = cut < usable ? memchr(cut, '\n', usable - cut) : NULL;
+                chunk->end = newline == NULL ? usable : newline + 1;
+            }
+
+            size_t lines = 0;
+            for (const char *p = chunk->begin; p < chunk->end; p = (char *) memchr(p, '\n', chunk->end - p) + 1)
+                lines++;
+            if (lines * CSV_RESULT_SIZE + 1 > outCapacity[i]){
+                ciLispFree(chunk->out);
+                outCapacity[i] = lines * CSV_RESULT_SIZE + 1;
+                chunk->out = ciLispAlloc(outCapacity[i], MEM_BUFFER);
+            }
+            chunk->outLength = 0;
+        }
+
+        for (int i = 1; i < threads; i++)
+            pthread_create(&workers[i], NULL, evalChunk, &chunks[i]);
+        evalChunk(&chunks[0]);
+        for (int i = 1; i < threads; i++)
+            pthread_join(workers[i], NULL);
+
+        for (int i = 0; i < threads; i++)
+            fwrite(chunks[i].out, 1, chunks[i].outLength, out);
+
+        length -= usable - buffer;
+        memmove(buffer, usable, length);
+    }
+
+    for (int i = 0; i < threads; i++){
+        options->badRows += chunks[i].badRows;
+        ciLispFree(chunks[i].inputs);
+        ciLispFree(chunks[i].out);
+    }
+    ciLispFree(columnInput);
+    ciLispFree(buffer);
+    fflush(out);
+    return status;
+}
@@ -0,0 +1,186 @@
+#include "ciLisp.h"
+
+// Persistent top-level definitions.
+// (define (x 5) (int f lambda (n) (mult n 2))) takes the same elements as a let section, but instead
+// of linking them to one s_expr they go into the global environment, which lives for the whole
+// session. lookup (and the inliner and compiler, which mirror it) consults it once the parent chain
+// of a node is exhausted, so later lines call f without sending or parsing it again.
+//
+// Defining a name again replaces the old definition. Variables keep let semantics: the value
+// expression is evaluated wherever the variable is used.
+// Definitions change what pure lines evaluate to, so every define flushes the result cache.
+// A definition whose value calls read, rand or print, directly or through other definitions, is
+// marked impure: lines naming it are neither cached nor parsed ahead of by the pipelined REPL.
+
+SYM_TABLE_NODE *globalTable;
+
+// Bytes the driver's thread had in use when the current line started, see beginLine.
+static ptrdiff_t lineStartBytes;
+static bool lineDefines;
+
+// Finds the global entry bound to name, or NULL.
+SYM_TABLE_NODE *lookupGlobal(const char *name)
+{
+    for (SYM_TABLE_NODE *entry = globalTable; entry != NULL; entry = entry->next){
+        if (strcmp(entry->id, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static void removeGlobal(const char *name)
+{
+    SYM_TABLE_NODE **link = &globalTable;
+    while (*link != NULL && strcmp((*link)->id, name) != 0)
+        link = &(*link)->next;
+    if (*link == NULL)
+        return;
+
+    SYM_TABLE_NODE *entry = *link;
+    *link = entry->next;
+    entry->next = NULL;
+    freeSymbolTable(entry);
+}
+
+static bool namesImpure(const char *name)
+{
+    SYM_TABLE_NODE *global = name != NULL ? lookupGlobal(name) : NULL;
+    return global != NULL && global->impure;
+}
+
+// Tells if evaluating node may call read, rand, print or an impure global. Names are matched
+// against the globals even where a let or param shadows them, which only errs on the safe side.
+static bool nodeImpure(const AST_NODE *node)
+{
+    if (node == NULL)
+        return false;
+    for (const SYM_TABLE_NODE *entry = node->table; entry != NULL; entry = entry->next){
+        if (nodeImpure(entry->value))
+            return true;
+    }
+
+    switch (node->type){
+        case SYM_NODE_TYPE:
+            return namesImpure(node->data.symbol.identifier);
+        case FUNC_NODE_TYPE:
+            switch (node->data.function.oper){
+                case READ_OPER:
+                case RAND_OPER:
+                case PRINT_OPER:
+                case MEMSTATS_OPER:
+                case CACHESTATS_OPER:
+                    return true;
+                case CUSTOM_OPER:
+                    if (namesImpure(node->data.function.ident))
+                        return true;
+                    break;
+                default:
+                    break;
+            }
+            for (const AST_NODE *op = node->data.function.opList; op != NULL; op = op->next){
+                if (nodeImpure(op))
+                    return true;
+            }
+            return false;
+        case COND_NODE_TYPE:
+            return nodeImpure(node->data.condition.cond) || nodeImpure(node->data.condition.nodeTrue)
+                   || nodeImpure(node->data.condition.nodeFalse);
+        case LOOP_NODE_TYPE:
+            return namesImpure(node->data.loop.func) || nodeImpure(node->data.loop.from)
+                   || nodeImpure(node->data.loop.to) || nodeImpure(node->data.loop.init)
+                   || nodeImpure(node->data.loop.body);
+        case BIND_NODE_TYPE:
+            for (const AST_NODE *arg = node->data.bind.args; arg != NULL; arg = arg->next){
+                if (nodeImpure(arg))
+                    return true;
+            }
+            return nodeImpure(node->data.bind.body);
+        default:
+            return false;
+    }
+}
+
+// Marks the impure globals again after a define. A definition may have changed what the others
+// call, so the flags are cleared and spread until they stop changing.
+static void markImpureGlobals(void)
+{
+    for (SYM_TABLE_NODE *entry = globalTable; entry != NULL; entry = entry->next)
+        entry->impure = false;
+
+    bool changed = true;
+    while (changed){
+        changed = false;
+        for (SYM_TABLE_NODE *entry = globalTable; entry != NULL; entry = entry->next){
+            if (!entry->impure && nodeImpure(entry->value)){
+                entry->impure = true;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Installs the entries of a define section into the global environment (see the program
+// production in ciLisp.y), taking them over.
+void defineSymbols(SYM_TABLE_NODE *table)
+{
+    // define_list is built back to front, the last definition of a name in the section wins
+    SYM_TABLE_NODE *reversed = NULL;
+    while (table != NULL){
+        SYM_TABLE_NODE *entry = table;
+        table = table->next;
+        entry->next = reversed;
+        reversed = entry;
+    }
+    table = reversed;
+
+    while (table != NULL){
+        SYM_TABLE_NODE *entry = table;
+        table = table->next;
+
+        removeGlobal(entry->id);
+        entry->value->parent = NULL;
+        inlineDefinition(entry->value);
+        entry->next = globalTable;
+        globalTable = entry;
+    }
+    markImpureGlobals();
+    flushResultCache();
+    lineDefines = true;
+}
+
+// Drivers call beginLine before scanning a line and endLine once its tokens are freed.
+// Whatever a define line left allocated on the driver's thread is the definitions it installed
+// (less the ones it replaced), which is excluded from the --strict-mem check like the result cache.
+void beginLine(void)
+{
+    lineStartBytes = ciLispThreadBytes();
+    lineDefines = false;
+}
+
+void endLine(void)
+{
+    if (lineDefines)
+        ciLispKeep(ciLispThreadBytes() - lineStartBytes);
+    lineDefines = false;
+}
+
+// Tells if the line is a define, which the pipelined REPL has to run in order with the lines around it.
+bool tokensDefine(const TOKEN_LIST *tokens)
+{
+    for (int i = 0; i < tokens->count; i++){
+        if (tokens->tokens[i].type == DEFINE)
+            return true;
+    }
+    return false;
+}
+
+// Tells if the line names an impure global, which buildKey and the pipelined REPL treat like a call to read.
+bool tokensImpure(const TOKEN_LIST *tokens)
+{
+    for (int i = 0; i < tokens->count; i++){
+        const TOKEN *token = &tokens->tokens[i];
+        if ((token->type == SYMBOL || token->type == FUNC) && namesImpure(token->value.sval))
+            return true;
+    }
+    return false;
+}
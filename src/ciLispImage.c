@@ -0,0 +1,171 @@
+#include "ciLisp.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Program images.
+// A compiled program is one block of instructions, functions and input names that refers to itself
+// only by index (see compileProgram), so it is already position independent. An image is that block
+// behind a header, and loading one maps the file and points a CILISP_PROGRAM into the mapping.
+// Whatever let and define lambdas the program reaches were compiled into it, so a prelude of any
+// size costs a single mmap at startup instead of being parsed, inlined and compiled again.
+//
+// The header pins down everything the block depends on besides its contents: the format version,
+// the byte order and the sizes and numbering of instructions, functions, values, opcodes and
+// builtins. An image from another build is rejected instead of run, and one that passes is still
+// checked by validProgram before it is used.
+
+#define IMAGE_MAGIC "ciLispIm"
+#define IMAGE_VERSION 2 // bump whenever an instruction or builtin changes what it does
+#define IMAGE_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t instrSize;
+    uint32_t functionSize;
+    uint32_t valueSize;
+    uint32_t opCount;
+    uint32_t operCount;
+    int32_t codeLength;
+    int32_t functionCount;
+    int32_t inputCount;
+    uint32_t namesSize;
+    uint32_t padding[3]; // keeps the code that follows aligned
+} IMAGE_HEADER;
+
+_Static_assert(sizeof(IMAGE_HEADER) % _Alignof(CILISP_INSTR) == 0, "image code must stay aligned");
+
+static IMAGE_HEADER imageHeader(const CILISP_PROGRAM *program)
+{
+    uint32_t namesSize = 0;
+    for (int i = 0; i < program->inputCount; i++)
+        namesSize += strlen(program->inputNames + namesSize) + 1;
+
+    IMAGE_HEADER header = {
+            .version = IMAGE_VERSION,
+            .byteOrder = IMAGE_BYTE_ORDER,
+            .instrSize = sizeof(CILISP_INSTR),
+            .functionSize = sizeof(CILISP_FUNCTION),
+            .valueSize = sizeof(RET_VAL),
+            .opCount = OP_HALT + 1,
+            .operCount = CACHESTATS_OPER + 1,
+            .codeLength = program->codeLength,
+            .functionCount = program->functionCount,
+            .inputCount = program->inputCount,
+            .namesSize = namesSize
+    };
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    return header;
+}
+
+CILISP_STATUS ciLispSaveImage(const CILISP_PROGRAM *program, const char *path)
+{
+    IMAGE_HEADER header = imageHeader(program);
+
+    char *temporary;
+    if ((temporary = ciLispAlloc(strlen(path) + 5, MEM_STRING)) == NULL)
+        return CILISP_IMAGE_ERROR;
+    sprintf(temporary, "%s.tmp", path);
+
+    FILE *file = fopen(temporary, "wb");
+    bool written = file != NULL
+                   && fwrite(&header, sizeof(header), 1, file) == 1
+                   && fwrite(program->code, sizeof(CILISP_INSTR), header.codeLength, file) == (size_t) header.codeLength
+                   && fwrite(program->functions, sizeof(CILISP_FUNCTION), header.functionCount, file) == (size_t) header.functionCount
+                   && fwrite(program->inputNames, 1, header.namesSize, file) == header.namesSize;
+    if (file != NULL && fclose(file) != 0)
+        written = false;
+    if (written && rename(temporary, path) != 0)
+        written = false;
+    if (!written)
+        remove(temporary);
+
+    ciLispFree(temporary);
+    return written ? CILISP_OK : CILISP_IMAGE_ERROR;
+}
+
+// Tells if the image was written by this build and its sections fill exactly size bytes.
+static bool headerMatches(const IMAGE_HEADER *header, size_t size)
+{
+    IMAGE_HEADER expected = imageHeader(&(CILISP_PROGRAM){0});
+    if (memcmp(header->magic, expected.magic, sizeof(expected.magic)) != 0
+        || header->version != expected.version
+        || header->byteOrder != expected.byteOrder
+        || header->instrSize != expected.instrSize
+        || header->functionSize != expected.functionSize
+        || header->valueSize != expected.valueSize
+        || header->opCount != expected.opCount
+        || header->operCount != expected.operCount)
+        return false;
+
+    if (header->codeLength < 0 || header->functionCount < 0 || header->inputCount < 0)
+        return false;
+    return size == sizeof(IMAGE_HEADER) + (size_t) header->codeLength * sizeof(CILISP_INSTR)
+                   + (size_t) header->functionCount * sizeof(CILISP_FUNCTION) + header->namesSize;
+}
+
+// Tells if the names section holds exactly inputCount NUL terminated names.
+static bool namesMatch(const char *names, uint32_t namesSize, int inputCount)
+{
+    int count = 0;
+    for (uint32_t i = 0; i < namesSize; i++){
+        if (names[i] == '\0')
+            count++;
+    }
+    return count == inputCount && (namesSize == 0 || names[namesSize - 1] == '\0');
+}
+
+CILISP_PROGRAM *ciLispLoadImage(const char *path, CILISP_STATUS *status)
+{
+    CILISP_STATUS ignored;
+    if (status == NULL)
+        status = &ignored;
+    *status = CILISP_IMAGE_ERROR;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    char *image = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t) info.st_size >= sizeof(IMAGE_HEADER))
+        image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return NULL;
+
+    const IMAGE_HEADER *header = (const IMAGE_HEADER *) image;
+    size_t codeSize = (size_t) header->codeLength * sizeof(CILISP_INSTR);
+    size_t functionsSize = (size_t) header->functionCount * sizeof(CILISP_FUNCTION);
+    const char *names = image + sizeof(IMAGE_HEADER) + codeSize + functionsSize;
+
+    CILISP_PROGRAM *program;
+    if (!headerMatches(header, info.st_size) || !namesMatch(names, header->namesSize, header->inputCount)
+        || (program = ciLispAlloc(sizeof(CILISP_PROGRAM), MEM_PROGRAM)) == NULL){
+        munmap(image, info.st_size);
+        return NULL;
+    }
+
+    program->code = (const CILISP_INSTR *) (image + sizeof(IMAGE_HEADER));
+    program->codeLength = header->codeLength;
+    program->functions = (const CILISP_FUNCTION *) (image + sizeof(IMAGE_HEADER) + codeSize);
+    program->functionCount = header->functionCount;
+    program->inputNames = names;
+    program->inputCount = header->inputCount;
+    program->block = image;
+    program->mappedSize = info.st_size;
+
+    if (!validProgram(program)){
+        ciLispFreeProgram(program);
+        return NULL;
+    }
+    *status = CILISP_OK;
+    return program;
+}
+
+void unmapImage(CILISP_PROGRAM *program)
+{
+    munmap(program->block, program->mappedSize);
+}
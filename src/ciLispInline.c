@@ -0,0 +1,212 @@
+#include "ciLisp.h"
+
+// Inlines calls to small let lambdas (runs on every parsed program, see ciLisp.y).
+// A call (f a b) to a lambda whose body is small and closed is turned into a BIND_NODE_TYPE node:
+// the args stay where they are and a private copy of the body gets the params as its arg table.
+// Evaluating it skips the lookup of f, the RET_VAL_LIST of args and the swapping in and out of
+// CUSTOM_OPER, and the lambda's declared return type is applied the same way.
+//
+// Only bodies made of numbers, params, builtin calls other than read/rand, and conds are inlined.
+// A body like that cannot recurse and does not depend on the scope it is defined in, so running a
+// copy at the call site gives the same result as the call.
+
+#define INLINE_MAX_NODES 32
+
+bool inlining = true;
+
+// Calls to defined lambdas are not inlined into other definitions, they are bound when called so
+// defining the callee again takes effect. See inlineDefinition.
+static bool inliningDefinition;
+
+// Counts the nodes of a lambda body, or returns -1 if it cannot be inlined.
+static int inlineSize(AST_NODE *node, ARG_TABLE_NODE *params)
+{
+    if (node->table != NULL || node->argTable != NULL)
+        return -1;
+
+    int size = 1;
+    int part;
+    switch (node->type){
+        case NUM_NODE_TYPE:
+            return size;
+        case SYM_NODE_TYPE:
+            for (ARG_TABLE_NODE *param = params; param != NULL; param = param->next){
+                if (strcmp(param->ident, node->data.symbol.identifier) == 0)
+                    return size;
+            }
+            return -1;
+        case FUNC_NODE_TYPE:
+            switch (node->data.function.oper){
+                case CUSTOM_OPER:
+                case READ_OPER:
+                case RAND_OPER:
+                case MEMSTATS_OPER:
+                case CACHESTATS_OPER:
+                    return -1;
+                default:
+                    break;
+            }
+            for (AST_NODE *op = node->data.function.opList; op != NULL; op = op->next){
+                if ((part = inlineSize(op, params)) < 0)
+                    return -1;
+                size += part;
+            }
+            return size;
+        case COND_NODE_TYPE:
+            if ((part = inlineSize(node->data.condition.cond, params)) < 0)
+                return -1;
+            size += part;
+            if ((part = inlineSize(node->data.condition.nodeTrue, params)) < 0)
+                return -1;
+            size += part;
+            if ((part = inlineSize(node->data.condition.nodeFalse, params)) < 0)
+                return -1;
+            return size + part;
+        default:
+            return -1;
+    }
+}
+
+// Size of a lambda body, whose root is the one node that holds an arg table (the params).
+static int bodySize(AST_NODE *body)
+{
+    ARG_TABLE_NODE *params = body->argTable;
+    body->argTable = NULL;
+    int size = inlineSize(body, params);
+    body->argTable = params;
+    return size;
+}
+
+static AST_NODE *copyNode(AST_NODE *node)
+{
+    AST_NODE *copy = NULL;
+    AST_NODE *ops = NULL;
+    AST_NODE **last = &ops;
+
+    switch (node->type){
+        case NUM_NODE_TYPE:
+            copy = createNumberNode(node->data.number.value.dval, node->data.number.type);
+            break;
+        case SYM_NODE_TYPE:
+            copy = createSymbolNode(ciLispStrdup(node->data.symbol.identifier));
+            break;
+        case FUNC_NODE_TYPE:
+            for (AST_NODE *op = node->data.function.opList; op != NULL; op = op->next){
+                *last = copyNode(op);
+                last = &(*last)->next;
+            }
+            copy = createFunctionNode(ciLispStrdup(funcNames[node->data.function.oper]), ops);
+            break;
+        case COND_NODE_TYPE:
+            copy = createCondNode(copyNode(node->data.condition.cond),
+                                  copyNode(node->data.condition.nodeTrue),
+                                  copyNode(node->data.condition.nodeFalse));
+            break;
+        default:
+            break;
+    }
+    return copy;
+}
+
+// Finds the let or defined lambda a call resolves to, the same way lookup does at run time.
+static SYM_TABLE_NODE *calledLambda(AST_NODE *call)
+{
+    char *name = call->data.function.ident;
+    for (AST_NODE *origin = call; origin != NULL; origin = origin->parent){
+        for (SYM_TABLE_NODE *entry = origin->table; entry != NULL; entry = entry->next){
+            if (strcmp(entry->id, name) == 0)
+                return entry->type == LAMBDA_TYPE ? entry : NULL;
+        }
+        for (ARG_TABLE_NODE *arg = origin->argTable; arg != NULL; arg = arg->next){
+            if (strcmp(arg->ident, name) == 0)
+                return NULL;
+        }
+    }
+    if (inliningDefinition)
+        return NULL;
+    SYM_TABLE_NODE *global = lookupGlobal(name);
+    return global != NULL && global->type == LAMBDA_TYPE ? global : NULL;
+}
+
+// Turns the call into a BIND_NODE_TYPE node in place, keeping its parent, next and let table.
+static void inlineCall(AST_NODE *call)
+{
+    SYM_TABLE_NODE *lambda = calledLambda(call);
+    if (lambda == NULL)
+        return;
+
+    AST_NODE *body = lambda->value;
+    int params = 0;
+    int args = 0;
+    for (ARG_TABLE_NODE *param = body->argTable; param != NULL; param = param->next)
+        params++;
+    for (AST_NODE *arg = call->data.function.opList; arg != NULL; arg = arg->next)
+        args++;
+    if (params != args || params > INLINE_MAX_PARAMS)
+        return;
+    int size = bodySize(body);
+    if (size < 0 || size > INLINE_MAX_NODES)
+        return;
+
+    AST_NODE *copy = copyNode(body);
+    ARG_TABLE_NODE *copyParams = NULL;
+    ARG_TABLE_NODE **last = &copyParams;
+    for (ARG_TABLE_NODE *param = body->argTable; param != NULL; param = param->next){
+        *last = createArgTableNode(ciLispStrdup(param->ident));
+        last = &(*last)->next;
+    }
+    copy->argTable = copyParams;
+    copy->parent = call;
+
+    AST_NODE *argList = call->data.function.opList;
+    char *name = call->data.function.ident;
+    call->type = BIND_NODE_TYPE;
+    ciLispRetype(call, MEM_BIND_NODE);
+    call->data.bind.args = argList;
+    call->data.bind.body = copy;
+    call->data.bind.type = lambda->val_type;
+    call->data.bind.func = name;
+}
+
+// Inlines every call it can below root, lambda bodies included. Returns root.
+AST_NODE *inlineCalls(AST_NODE *root)
+{
+    if (!inlining)
+        return root;
+
+    for (AST_NODE *node = root; node != NULL; node = node->next){
+        for (SYM_TABLE_NODE *entry = node->table; entry != NULL; entry = entry->next)
+            inlineCalls(entry->value);
+
+        switch (node->type){
+            case FUNC_NODE_TYPE:
+                inlineCalls(node->data.function.opList);
+                if (node->data.function.oper == CUSTOM_OPER)
+                    inlineCall(node);
+                break;
+            case COND_NODE_TYPE:
+                inlineCalls(node->data.condition.cond);
+                inlineCalls(node->data.condition.nodeTrue);
+                inlineCalls(node->data.condition.nodeFalse);
+                break;
+            case LOOP_NODE_TYPE:
+                inlineCalls(node->data.loop.from);
+                inlineCalls(node->data.loop.to);
+                inlineCalls(node->data.loop.init);
+                inlineCalls(node->data.loop.body);
+                break;
+            default:
+                break;
+        }
+    }
+    return root;
+}
+
+// inlineCalls for the value of a define, calls to other defined lambdas are left alone.
+AST_NODE *inlineDefinition(AST_NODE *value)
+{
+    inliningDefinition = true;
+    inlineCalls(value);
+    inliningDefinition = false;
+    return value;
+}
@@ -0,0 +1,278 @@
+#include "ciLisp.h"
+
+// Math kernels behind exp, log, pow, exp2, cbrt, sqrt and hypot.
+// In strict mode (the default) every kernel is the libm function, so results are bit for bit the
+// ones libm gives. Fast mode (--fast-math, ciLispSetFastMath) swaps in polynomial approximations:
+// exp, exp2, log and cbrt stay within 3 ULP, and hypot is sqrt(x*x + y*y), which is within 2 ULP
+// wherever it can't overflow or underflow. sqrt is the same in both modes, it is a single correctly
+// rounded instruction already. pow stays on libm in both modes: exp(y * log(x)) in plain doubles
+// multiplies the error of log by |y * log(x)|, hundreds of ULP over ordinary arguments, and getting
+// that down to a few ULP needs log and exp carried in extended precision.
+//
+// The fast kernels are straight line code without calls or branches, so the batch entry points
+// (mathUnaryBatch, mathBinaryBatch) are plain loops compilers turn into SIMD code (this file is
+// built with -O3, see CMakeLists.txt). Arguments a kernel does not cover (non-finite, out of range,
+// zero or negative where it matters) are sent to libm by a second, scalar pass.
+
+bool fastMath = false;
+
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define INV_LN2 1.44269504088896338700e+00
+#define ROUND_SHIFT 0x1.8p52 // adding it rounds a double below 2^51 to an integer in the low bits
+
+// ranges the fast kernels handle, anything else goes to libm
+#define EXP_MIN -708.0
+#define EXP_MAX 709.0
+#define EXP2_MIN -1022.0
+#define EXP2_MAX 1023.0
+#define HYPOT_MIN 0x1p-500
+#define HYPOT_MAX 0x1p500
+
+static inline uint64_t asBits(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+static inline double asDouble(uint64_t bits)
+{
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// 2^k for an integer valued double k the exponent field can hold
+static inline double powerOfTwo(double k)
+{
+    return asDouble((asBits(k + ROUND_SHIFT) + 1023) << 52);
+}
+
+// e^r for |r| <= ln2 / 2, Taylor series to r^13 (truncation below 2^-57)
+static inline double expPoly(double r)
+{
+    double p = 1.0 / 6227020800.0;
+    p = p * r + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    return p * r + 1.0;
+}
+
+// x = k ln2 + r, e^x = 2^k e^r. Valid for EXP_MIN <= x <= EXP_MAX.
+static inline double fastExp(double x)
+{
+    double k = (x * INV_LN2 + ROUND_SHIFT) - ROUND_SHIFT;
+    double r = (x - k * LN2_HI) - k * LN2_LO;
+    return expPoly(r) * powerOfTwo(k);
+}
+
+// Valid for EXP2_MIN <= x <= EXP2_MAX.
+static inline double fastExp2(double x)
+{
+    double k = (x + ROUND_SHIFT) - ROUND_SHIFT;
+    return expPoly((x - k) * (LN2_HI + LN2_LO)) * powerOfTwo(k);
+}
+
+// Small non negative integer held in the low bits of a uint64_t, as a double.
+static inline double smallToDouble(uint64_t n)
+{
+    return asDouble(n | 0x4330000000000000ULL) - 0x1p52;
+}
+
+// x = m 2^e with sqrt(1/2) <= m < sqrt(2), log(m) = 2 atanh(s) for s = (m - 1) / (m + 1).
+// Valid for positive normal finite x.
+static inline double fastLog(double x)
+{
+    // moving the bits of sqrt(1/2) to 1.0 puts m in the mantissa and e + 1023 in the exponent
+    uint64_t bits = asBits(x) - 0x3FE6A09E667F3BCDULL + 0x3FF0000000000000ULL;
+    double ed = smallToDouble(bits >> 52) - 1023.0;
+    double m = asDouble((bits & 0x000FFFFFFFFFFFFFULL) + 0x3FE6A09E667F3BCDULL);
+    double f = m - 1.0;
+    double s = f / (2.0 + f);
+    double s2 = s * s;
+    double p = 1.0 / 21.0;
+    p = p * s2 + 1.0 / 19.0;
+    p = p * s2 + 1.0 / 17.0;
+    p = p * s2 + 1.0 / 15.0;
+    p = p * s2 + 1.0 / 13.0;
+    p = p * s2 + 1.0 / 11.0;
+    p = p * s2 + 1.0 / 9.0;
+    p = p * s2 + 1.0 / 7.0;
+    p = p * s2 + 1.0 / 5.0;
+    p = p * s2 + 1.0 / 3.0;
+    // log(m) = f - (f^2/2 - s(f^2/2 + 2 s^2 p)), keeping f apart makes the result accurate near 1
+    double halfF2 = 0.5 * f * f;
+    return ed * LN2_HI + (f - (halfF2 - s * (halfF2 + 2.0 * s2 * p)) + ed * LN2_LO);
+}
+
+// x = m 2^(3q + r) with 1 <= m < 2 and r in -1..1, cbrt(x) = cbrt(m 2^r) 2^q.
+// cbrt(m 2^r) starts from a cubic fit (within 2%) and takes four Newton steps.
+// Valid for positive normal finite x.
+static inline double fastCbrt(double x)
+{
+    uint64_t bits = asBits(x);
+    double e = smallToDouble(bits >> 52) - 1023.0;
+    double m = asDouble((bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL);
+    double q = (e * (1.0 / 3.0) + ROUND_SHIFT) - ROUND_SHIFT;
+    double w = m * powerOfTwo(e - 3.0 * q);
+    double y = ((0.010880777368777506 * w - 0.11024101710003177) * w + 0.5220744240465649) * w + 0.5726408238842955;
+    y = y - (y * y * y - w) / (3.0 * y * y);
+    y = y - (y * y * y - w) / (3.0 * y * y);
+    y = y - (y * y * y - w) / (3.0 * y * y);
+    y = y - (y * y * y - w) / (3.0 * y * y);
+    return y * powerOfTwo(q);
+}
+
+static inline bool expInRange(double x)
+{
+    return x >= EXP_MIN && x <= EXP_MAX;
+}
+
+static inline bool exp2InRange(double x)
+{
+    return x >= EXP2_MIN && x <= EXP2_MAX;
+}
+
+static inline bool logInRange(double x)
+{
+    return x >= DBL_MIN && x <= DBL_MAX;
+}
+
+static inline bool cbrtInRange(double x)
+{
+    return logInRange(fabs(x));
+}
+
+static inline bool hypotInRange(double x, double y)
+{
+    double big = fmax(fabs(x), fabs(y));
+    return big >= HYPOT_MIN && big <= HYPOT_MAX;
+}
+
+double mathExp(double x)
+{
+    return fastMath && expInRange(x) ? fastExp(x) : exp(x);
+}
+
+double mathExp2(double x)
+{
+    return fastMath && exp2InRange(x) ? fastExp2(x) : exp2(x);
+}
+
+double mathLog(double x)
+{
+    return fastMath && logInRange(x) ? fastLog(x) : log(x);
+}
+
+static inline double signedCbrt(double x)
+{
+    return copysign(fastCbrt(fabs(x)), x);
+}
+
+double mathCbrt(double x)
+{
+    return fastMath && cbrtInRange(x) ? signedCbrt(x) : cbrt(x);
+}
+
+double mathPow(double x, double y)
+{
+    return pow(x, y);
+}
+
+double mathHypot(double x, double y)
+{
+    return fastMath && hypotInRange(x, y) ? sqrt(x * x + y * y) : hypot(x, y);
+}
+
+// The fast kernels are plain arithmetic on any argument, so the first pass runs them on everything
+// without branches and the second pass replaces the results of arguments out of their range.
+// Batches go through a small buffer so out can be the same array as the input.
+// On x86-64 GCC also builds the batch loops for AVX2 and picks that version at load time where the
+// processor has it, which doubles the vector width without building everything for AVX2.
+#define BATCH_CHUNK 64
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define BATCH_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BATCH_CLONES
+#endif
+
+#define FAST_BATCH(kernel, inRange, libm) \
+    for (size_t start = 0; start < n; start += BATCH_CHUNK){ \
+        size_t count = n - start < BATCH_CHUNK ? n - start : BATCH_CHUNK; \
+        double fast[BATCH_CHUNK]; \
+        for (size_t i = 0; i < count; i++) \
+            fast[i] = kernel(in[start + i]); \
+        for (size_t i = 0; i < count; i++) \
+            out[start + i] = inRange(in[start + i]) ? fast[i] : libm(in[start + i]); \
+    }
+
+#define STRICT_BATCH(libm) \
+    for (size_t i = 0; i < n; i++) \
+        out[i] = libm(in[i]);
+
+// Applies a unary kernel to n values, out may be in. Returns false if oper has no kernel.
+BATCH_CLONES bool mathUnaryBatch(OPER_TYPE oper, const double *in, double *out, size_t n)
+{
+    switch (oper){
+        case EXP_OPER:
+            if (fastMath)
+                FAST_BATCH(fastExp, expInRange, exp)
+            else
+                STRICT_BATCH(exp)
+            return true;
+        case EXP2_OPER:
+            if (fastMath)
+                FAST_BATCH(fastExp2, exp2InRange, exp2)
+            else
+                STRICT_BATCH(exp2)
+            return true;
+        case LOG_OPER:
+            if (fastMath)
+                FAST_BATCH(fastLog, logInRange, log)
+            else
+                STRICT_BATCH(log)
+            return true;
+        case CBRT_OPER:
+            if (fastMath)
+                FAST_BATCH(signedCbrt, cbrtInRange, cbrt)
+            else
+                STRICT_BATCH(cbrt)
+            return true;
+        case SQRT_OPER:
+            STRICT_BATCH(sqrt)
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Applies a binary kernel to n pairs, out may be x or y. Returns false if oper has no kernel.
+BATCH_CLONES bool mathBinaryBatch(OPER_TYPE oper, const double *x, const double *y, double *out, size_t n)
+{
+    switch (oper){
+        case POW_OPER:
+            for (size_t i = 0; i < n; i++)
+                out[i] = pow(x[i], y[i]);
+            return true;
+        case HYPOT_OPER:
+            for (size_t i = 0; i < n; i++){
+                double a = x[i];
+                double b = y[i];
+                out[i] = fastMath && hypotInRange(a, b) ? sqrt(a * a + b * b) : hypot(a, b);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
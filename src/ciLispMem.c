@@ -0,0 +1,277 @@
+#include "ciLisp.h"
+#include <stdatomic.h>
+
+// Counted allocator.
+// Every allocation in the interpreter goes through ciLispAlloc so live/peak bytes and
+// per kind counts can be reported by (memstats), --mem-report and checked by --strict-mem.
+
+// Names for the MEM_KIND enum, must be in sync with it.
+char *memKindNames[] = {
+        "num nodes",
+        "func nodes",
+        "sym nodes",
+        "cond nodes",
+        "loop nodes",
+        "bind nodes",
+        "symbol tables",
+        "arg tables",
+        "strings",
+        "eval scratch",
+        "programs",
+        "buffers",
+        "cache entries"
+};
+
+// Stored in front of every block so ciLispFree knows what it is releasing.
+// Sized to keep the returned pointer aligned for any type.
+typedef union mem_header {
+    struct {
+        size_t size;
+        MEM_KIND kind;
+    } info;
+    max_align_t align;
+} MEM_HEADER;
+
+// Counters are atomic so the pipelined REPL can allocate on its reader thread while the evaluator
+// thread frees, ciLispMemStats takes a snapshot of them.
+static struct {
+    atomic_size_t liveBytes;
+    atomic_size_t peakBytes;
+    atomic_size_t liveKindBytes[MEM_KIND_COUNT];
+    atomic_size_t liveCount[MEM_KIND_COUNT];
+    atomic_size_t totalCount[MEM_KIND_COUNT];
+    atomic_size_t keptBytes;
+} memStats;
+
+// Bytes the calling thread allocated minus the bytes it freed, leaving out the result cache.
+// Lets a driver see what one line kept on its own thread while another thread allocates and frees.
+static _Thread_local ptrdiff_t threadBytes;
+
+#define COUNT_ADD(counter, n) atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define COUNT_SUB(counter, n) atomic_fetch_sub_explicit(&(counter), (n), memory_order_relaxed)
+#define COUNT_GET(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+bool memStrict = false;
+
+void *ciLispAlloc(size_t size, MEM_KIND kind)
+{
+    MEM_HEADER *header;
+    if ((header = calloc(sizeof(MEM_HEADER) + size, 1)) == NULL)
+        return NULL;
+
+    header->info.size = size;
+    header->info.kind = kind;
+
+    size_t live = COUNT_ADD(memStats.liveBytes, size) + size;
+    size_t peak = COUNT_GET(memStats.peakBytes);
+    while (live > peak && !atomic_compare_exchange_weak(&memStats.peakBytes, &peak, live))
+        ;
+    COUNT_ADD(memStats.liveKindBytes[kind], size);
+    COUNT_ADD(memStats.liveCount[kind], 1);
+    COUNT_ADD(memStats.totalCount[kind], 1);
+    if (kind != MEM_CACHE)
+        threadBytes += size;
+
+    return header + 1;
+}
+
+// Grows or shrinks a block from ciLispAlloc, keeping its kind. New bytes are zeroed.
+void *ciLispRealloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return NULL;
+
+    MEM_HEADER *header = (MEM_HEADER *) ptr - 1;
+    void *copy;
+    if ((copy = ciLispAlloc(size, header->info.kind)) == NULL)
+        return NULL;
+
+    memcpy(copy, ptr, header->info.size < size ? header->info.size : size);
+    COUNT_SUB(memStats.totalCount[header->info.kind], 1);
+    ciLispFree(ptr);
+    return copy;
+}
+
+// Counts a block from ciLispAlloc as kind from now on, for nodes changed into another type in place.
+void ciLispRetype(void *ptr, MEM_KIND kind)
+{
+    MEM_HEADER *header = (MEM_HEADER *) ptr - 1;
+    MEM_KIND old = header->info.kind;
+    COUNT_SUB(memStats.liveKindBytes[old], header->info.size);
+    COUNT_SUB(memStats.liveCount[old], 1);
+    COUNT_SUB(memStats.totalCount[old], 1);
+    COUNT_ADD(memStats.liveKindBytes[kind], header->info.size);
+    COUNT_ADD(memStats.liveCount[kind], 1);
+    COUNT_ADD(memStats.totalCount[kind], 1);
+    header->info.kind = kind;
+}
+
+void ciLispFree(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    MEM_HEADER *header = (MEM_HEADER *) ptr - 1;
+    COUNT_SUB(memStats.liveBytes, header->info.size);
+    COUNT_SUB(memStats.liveKindBytes[header->info.kind], header->info.size);
+    COUNT_SUB(memStats.liveCount[header->info.kind], 1);
+    if (header->info.kind != MEM_CACHE)
+        threadBytes -= header->info.size;
+    free(header);
+}
+
+char *ciLispStrdup(const char *s)
+{
+    char *copy;
+    size_t len = strlen(s) + 1;
+    if ((copy = ciLispAlloc(len, MEM_STRING)) == NULL)
+        yyerror("Memory allocation failed!");
+    else
+        memcpy(copy, s, len);
+    return copy;
+}
+
+MEM_STATS ciLispMemStats(void)
+{
+    MEM_STATS stats;
+    stats.liveBytes = COUNT_GET(memStats.liveBytes);
+    stats.peakBytes = COUNT_GET(memStats.peakBytes);
+    for (int i = 0; i < MEM_KIND_COUNT; i++){
+        stats.liveKindBytes[i] = COUNT_GET(memStats.liveKindBytes[i]);
+        stats.liveCount[i] = COUNT_GET(memStats.liveCount[i]);
+        stats.totalCount[i] = COUNT_GET(memStats.totalCount[i]);
+    }
+    return stats;
+}
+
+// prints live/peak bytes and the live/total count for every kind
+void printMemStats(FILE *out)
+{
+    MEM_STATS stats = ciLispMemStats();
+    fprintf(out, "Memory: live %zu bytes, peak %zu bytes\n", stats.liveBytes, stats.peakBytes);
+    for (int i = 0; i < MEM_KIND_COUNT; i++)
+    {
+        fprintf(out, "  %-14s live %zu, total %zu\n", memKindNames[i], stats.liveCount[i], stats.totalCount[i]);
+    }
+}
+
+// registered with atexit by --mem-report
+void printMemReport(void)
+{
+    printf("\n");
+    printMemStats(stdout);
+}
+
+ptrdiff_t ciLispThreadBytes(void)
+{
+    return threadBytes;
+}
+
+// Marks bytes as kept across expressions (definitions, see ciLispDefine.c), negative to give them back.
+void ciLispKeep(ptrdiff_t bytes)
+{
+    COUNT_ADD(memStats.keptBytes, (size_t) bytes);
+}
+
+// Live bytes without the memory that is kept across expressions on purpose (the result cache and
+// definitions).
+size_t expressionLiveBytes(void)
+{
+    return COUNT_GET(memStats.liveBytes) - COUNT_GET(memStats.liveKindBytes[MEM_CACHE]) - COUNT_GET(memStats.keptBytes);
+}
+
+static void failMemStrict(size_t leaked)
+{
+    printf("ERROR: strict memory check failed, %zu bytes still live after expression\n", leaked);
+    printMemStats(stdout);
+    exit(EXIT_FAILURE);
+}
+
+// Called by the driver after a top-level expression has been freed.
+// In strict mode anything still live beyond what was live before the expression is a leak.
+// liveBefore is the expressionLiveBytes from before the expression.
+void checkMemStrict(size_t liveBefore)
+{
+    if (memStrict && expressionLiveBytes() > liveBefore)
+        failMemStrict(expressionLiveBytes() - liveBefore);
+}
+
+// checkMemStrict for the pipelined REPL, which parses a line on one thread and evaluates and frees it
+// on another while the next lines are parsed, so the global counters can't be compared.
+// leaked is what the line left allocated, added up from the ciLispThreadBytes of both threads.
+void checkLineMemStrict(ptrdiff_t leaked)
+{
+    if (memStrict && leaked > 0)
+        failMemStrict(leaked);
+}
+
+// Eval scratch: a stack of chunks that call args (RET_VAL_LIST) are bumped off.
+// Memory taken after a scratchMark is given back all at once by scratchRelease with that mark,
+// which is also how tryEval drops whatever an expression that raised an error had taken.
+// Only the thread running eval uses it.
+
+#define SCRATCH_CHUNK_SIZE 16384
+
+typedef struct scratch_chunk {
+    struct scratch_chunk *prev;
+    size_t used;
+    size_t size;
+    _Alignas(max_align_t) char data[];
+} SCRATCH_CHUNK;
+
+static SCRATCH_CHUNK *scratchTop;
+static SCRATCH_CHUNK *scratchSpare; // last chunk given back, reused by the next one needed
+
+void *scratchAlloc(size_t size)
+{
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    if (scratchTop == NULL || scratchTop->size - scratchTop->used < size){
+        SCRATCH_CHUNK *chunk;
+        size_t chunkSize = size > SCRATCH_CHUNK_SIZE ? size : SCRATCH_CHUNK_SIZE;
+        if (scratchSpare != NULL && scratchSpare->size >= size){
+            chunk = scratchSpare;
+            scratchSpare = NULL;
+        } else if ((chunk = ciLispAlloc(sizeof(SCRATCH_CHUNK) + chunkSize, MEM_SCRATCH)) == NULL){
+            return NULL;
+        } else {
+            chunk->size = chunkSize;
+        }
+        chunk->prev = scratchTop;
+        chunk->used = 0;
+        scratchTop = chunk;
+    }
+    void *block = scratchTop->data + scratchTop->used;
+    scratchTop->used += size;
+    return block;
+}
+
+SCRATCH_MARK scratchMark(void)
+{
+    SCRATCH_MARK mark = {scratchTop, scratchTop == NULL ? 0 : scratchTop->used};
+    return mark;
+}
+
+// Gives back everything taken since mark.
+void scratchRelease(SCRATCH_MARK mark)
+{
+    while (scratchTop != mark.chunk){
+        SCRATCH_CHUNK *chunk = scratchTop;
+        scratchTop = chunk->prev;
+        if (scratchSpare == NULL)
+            scratchSpare = chunk;
+        else
+            ciLispFree(chunk);
+    }
+    if (scratchTop != NULL)
+        scratchTop->used = mark.used;
+}
+
+// Frees the spare chunk once nothing is in use, so no scratch memory stays live between
+// top-level expressions.
+void scratchTrim(void)
+{
+    if (scratchTop != NULL)
+        return;
+    ciLispFree(scratchSpare);
+    scratchSpare = NULL;
+}
@@ -0,0 +1,145 @@
+#include "ciLisp.h"
+#include <pthread.h>
+#include <semaphore.h>
+
+// Pipelined REPL (--pipeline, ciLispRunPipeline).
+// The calling thread reads, scans and parses lines and hands the parsed trees to an evaluator
+// thread through a bounded single producer single consumer ring, so reading and parsing the next
+// lines overlaps with evaluating the current one. The evaluator prints results in line order.
+// A line that calls read takes its input from the same stream, so the reader waits until that
+// line has been evaluated before it reads on. A define waits for every line before it to be evaluated,
+// so no line sees a definition made after it or one that has been replaced.
+// quit ends the stream once everything before it has run.
+// With the result cache on, the reader builds each line's key and the evaluator looks it up, so only
+// the evaluator touches the cache (a define flushes it while the evaluator waits at the barrier).
+
+#define PIPELINE_DEPTH 256
+
+// A parsed line on its way to the evaluator.
+typedef struct {
+    AST_NODE *node;   // NULL marks the end of the input, or a barrier if serial
+    bool serial;      // the reader waits for serialDone after queueing the line
+    char *key;        // the line's cacheKey, NULL if it isn't cached
+    size_t keyLength;
+    ptrdiff_t bytes;  // what the reader allocated for the line and hands over (node and key)
+} PIPELINE_LINE;
+
+typedef struct {
+    PIPELINE_LINE lines[PIPELINE_DEPTH];
+    size_t head;                     // only touched by the evaluator
+    size_t tail;                     // only touched by the reader
+    sem_t filled;
+    sem_t free;
+    sem_t serialDone;
+} PIPELINE;
+
+static PIPELINE *pipeline;
+
+// tree of the line the reader is parsing
+static AST_NODE *lineNode;
+
+static void push(PIPELINE_LINE line)
+{
+    sem_wait(&pipeline->free);
+    pipeline->lines[pipeline->tail % PIPELINE_DEPTH] = line;
+    pipeline->tail++;
+    sem_post(&pipeline->filled);
+}
+
+// Evaluates the queued lines in order. --strict-mem is checked per line: what the evaluator frees
+// of a line has to make up for what the reader allocated for it.
+static void *evalNodes(void *arg)
+{
+    (void) arg;
+    while (true){
+        sem_wait(&pipeline->filled);
+        PIPELINE_LINE line = pipeline->lines[pipeline->head % PIPELINE_DEPTH];
+        pipeline->head++;
+        sem_post(&pipeline->free);
+
+        if (line.node == NULL && !line.serial)
+            break;
+        if (line.node != NULL){
+            ptrdiff_t before = ciLispThreadBytes();
+            evalCachedProgram(line.node, line.key, line.keyLength);
+            checkLineMemStrict(ciLispThreadBytes() - before + line.bytes);
+        }
+        if (line.serial)
+            sem_post(&pipeline->serialDone);
+    }
+    return NULL;
+}
+
+// programHandler on the reader thread, keeps the tree until the line is done and can be queued.
+static void queueProgram(AST_NODE *node)
+{
+    lineNode = node;
+}
+
+void runPipeline(FILE *in)
+{
+    if ((pipeline = ciLispAlloc(sizeof(PIPELINE), MEM_BUFFER)) == NULL){
+        yyerror("Memory allocation failed!");
+        return;
+    }
+    sem_init(&pipeline->filled, 0, 0);
+    sem_init(&pipeline->free, 0, PIPELINE_DEPTH);
+    sem_init(&pipeline->serialDone, 0, 0);
+
+    pthread_t evaluator;
+    pthread_create(&evaluator, NULL, evalNodes, NULL);
+    programHandler = queueProgram;
+
+    char *line = NULL;
+    size_t lineSize = 0;
+    while (getline(&line, &lineSize, in) != -1){
+        TOKEN_LIST tokens = {NULL, 0, 0, 0};
+        ptrdiff_t lineStart = ciLispThreadBytes();
+        beginLine();
+        scanLine(line, &tokens);
+
+        bool quit = false;
+        for (int i = 0; i < tokens.count; i++)
+            quit = quit || tokens.tokens[i].type == QUIT;
+        if (quit){
+            freeTokens(&tokens);
+            break;
+        }
+        bool defines = tokensDefine(&tokens);
+        if (defines){
+            push((PIPELINE_LINE){NULL, true, NULL, 0, 0});
+            sem_wait(&pipeline->serialDone);
+        }
+
+        PIPELINE_LINE queued = {NULL, tokensCall(&tokens, READ_OPER) || tokensImpure(&tokens), NULL, 0, 0};
+        queued.key = cacheKey(&tokens, &queued.keyLength);
+        lineNode = NULL;
+        parseTokens(&tokens);
+        freeTokens(&tokens);
+        queued.node = lineNode;
+        queued.bytes = ciLispThreadBytes() - lineStart;
+        endLine();
+
+        if (queued.node != NULL){
+            push(queued);
+            if (queued.serial)
+                sem_wait(&pipeline->serialDone);
+        } else {
+            ciLispFree(queued.key);
+            // a define keeps what it allocated (see endLine), anything else left over is a parse leak
+            if (!defines)
+                checkLineMemStrict(ciLispThreadBytes() - lineStart);
+        }
+    }
+    free(line);
+
+    push((PIPELINE_LINE){NULL, false, NULL, 0, 0});
+    pthread_join(evaluator, NULL);
+    programHandler = evalProgram;
+
+    sem_destroy(&pipeline->filled);
+    sem_destroy(&pipeline->free);
+    sem_destroy(&pipeline->serialDone);
+    ciLispFree(pipeline);
+    pipeline = NULL;
+}
@@ -0,0 +1,1123 @@
+#include "ciLisp.h"
+
+// Compiles an AST into a flat program for the embedding API (see ciLispApi.h) and runs it.
+// Names are resolved once at compile time to frame slots, inputs and function indexes, so running a
+// program never looks at the AST, never compares strings and never allocates. Each run keeps its
+// operand stack and frames on the C stack, which makes a program safe to run from several threads.
+//
+// Differences from eval:
+// - let variables are evaluated once when their let is entered instead of on every reference
+// - read, memstats and cachestats are not supported
+// - print prints the values of its operands
+
+#define PROGRAM_STACK_SIZE 4096
+#define PROGRAM_FRAME_COUNT 1024
+
+typedef enum {
+    RESOLVED_NONE,
+    RESOLVED_VARIABLE,
+    RESOLVED_LAMBDA,
+    RESOLVED_ARG
+} RESOLVED_TYPE;
+
+typedef enum {
+    BINDING_PENDING,
+    BINDING_IN_PROGRESS,
+    BINDING_DONE
+} BINDING_STATE;
+
+// Where a let variable, lambda arg or loop variable lives at run time.
+typedef struct {
+    void *key; // the SYM_TABLE_NODE or ARG_TABLE_NODE the name is bound by
+    int function;
+    int slot;
+    BINDING_STATE state;
+    int scanMark;
+} COMPILE_BINDING;
+
+typedef struct {
+    CILISP_INSTR *code;
+    int codeLength;
+    int codeCapacity;
+    CILISP_FUNCTION *functions;
+    int functionCount;
+    int functionCapacity;
+    AST_NODE **bodies; // parallel to functions, NULL for the program itself
+    int bodiesCapacity;
+    COMPILE_BINDING *bindings;
+    int bindingCount;
+    int bindingCapacity;
+    const char *const *inputNames;
+    int inputCount;
+    int function; // function being compiled
+    int depth;    // operand stack depth at the end of the code emitted so far
+    int scanMark;
+    bool failed;
+} COMPILER;
+
+typedef struct {
+    int32_t base;     // stack index of slot 0
+    int32_t link;     // frame of the enclosing definition
+    int32_t returnPc;
+} PROGRAM_FRAME;
+
+static void compileNode(COMPILER *c, AST_NODE *node);
+
+static void compileError(COMPILER *c, const char *format, const char *name)
+{
+    char message[BUFSIZ];
+    snprintf(message, sizeof(message), format, name);
+    yyerror(message);
+    c->failed = true;
+}
+
+// Makes room for one more element in a growable compiler array.
+static void *reserve(void *array, int count, int *capacity, size_t elementSize)
+{
+    if (count < *capacity)
+        return array;
+
+    *capacity = *capacity == 0 ? 16 : *capacity * 2;
+    if (array == NULL)
+        return ciLispAlloc(*capacity * elementSize, MEM_PROGRAM);
+    return ciLispRealloc(array, *capacity * elementSize);
+}
+
+static int emit(COMPILER *c, CODE_OP op, int a, int b, int cc)
+{
+    c->code = reserve(c->code, c->codeLength, &c->codeCapacity, sizeof(CILISP_INSTR));
+    CILISP_INSTR *instr = &c->code[c->codeLength];
+    instr->op = op;
+    instr->a = a;
+    instr->b = b;
+    instr->c = cc;
+
+    switch (op){
+        case OP_CONST:
+        case OP_INPUT:
+        case OP_LOAD:
+        case OP_RAND:
+            c->depth++;
+            break;
+        case OP_STORE:
+        case OP_BINARY:
+        case OP_JUMP_FALSE:
+            c->depth--;
+            break;
+        case OP_CALL:
+            c->depth -= b - 1;
+            break;
+        case OP_PRINT:
+            c->depth -= b - 1;
+            break;
+        default:
+            break;
+    }
+    if (c->depth > c->functions[c->function].maxDepth)
+        c->functions[c->function].maxDepth = c->depth;
+
+    return c->codeLength++;
+}
+
+static void emitConst(COMPILER *c, NUM_TYPE type, double value)
+{
+    int at = emit(c, OP_CONST, 0, 0, 0);
+    c->code[at].value.type = type;
+    c->code[at].value.value.dval = value;
+}
+
+static bool isLoopBody(AST_NODE *node)
+{
+    return node->parent != NULL && node->parent->type == LOOP_NODE_TYPE && node->parent->data.loop.body == node;
+}
+
+// the body of an inlined call, its params live in the frame of the function it was inlined into
+static bool isBindBody(AST_NODE *node)
+{
+    return node->parent != NULL && node->parent->type == BIND_NODE_TYPE && node->parent->data.bind.body == node;
+}
+
+// Lambda body whose frame holds the bindings made at node, NULL for the program itself.
+static AST_NODE *functionRootOf(AST_NODE *node)
+{
+    while (node != NULL){
+        if (node->argTable != NULL && !isLoopBody(node) && !isBindBody(node))
+            return node;
+        node = node->parent;
+    }
+    return NULL;
+}
+
+static int functionIndexOf(COMPILER *c, AST_NODE *body)
+{
+    for (int i = 0; i < c->functionCount; i++){
+        if (c->bodies[i] == body)
+            return i;
+    }
+    return -1;
+}
+
+// Mirrors lookup: finds the table entry name is bound to as seen from origin, without evaluating anything.
+// Defined names have no owner. Programs keep the code compiled from them, defining them again later
+// does not change a compiled program.
+static RESOLVED_TYPE resolveSymbol(char *name, AST_NODE *origin, void **entry, AST_NODE **owner)
+{
+    while (origin != NULL){
+        for (SYM_TABLE_NODE *current = origin->table; current != NULL; current = current->next){
+            if (strcmp(current->id, name) == 0){
+                *entry = current;
+                *owner = origin;
+                return current->type == LAMBDA_TYPE ? RESOLVED_LAMBDA : RESOLVED_VARIABLE;
+            }
+        }
+        for (ARG_TABLE_NODE *current = origin->argTable; current != NULL; current = current->next){
+            if (strcmp(current->ident, name) == 0){
+                *entry = current;
+                *owner = origin;
+                return RESOLVED_ARG;
+            }
+        }
+        origin = origin->parent;
+    }
+    SYM_TABLE_NODE *global = lookupGlobal(name);
+    if (global != NULL){
+        *entry = global;
+        *owner = NULL;
+        return global->type == LAMBDA_TYPE ? RESOLVED_LAMBDA : RESOLVED_VARIABLE;
+    }
+    return RESOLVED_NONE;
+}
+
+// Returns the index of the binding for key, creating it in a fresh slot of function if needed.
+static int bindingFor(COMPILER *c, void *key, int function)
+{
+    for (int i = 0; i < c->bindingCount; i++){
+        if (c->bindings[i].key == key)
+            return i;
+    }
+
+    c->bindings = reserve(c->bindings, c->bindingCount, &c->bindingCapacity, sizeof(COMPILE_BINDING));
+    COMPILE_BINDING *binding = &c->bindings[c->bindingCount];
+    binding->key = key;
+    binding->function = function;
+    binding->slot = function < 0 ? -1 : c->functions[function].nSlots++;
+    binding->state = BINDING_PENDING;
+    binding->scanMark = 0;
+    return c->bindingCount++;
+}
+
+static int newSlot(COMPILER *c)
+{
+    return c->functions[c->function].nSlots++;
+}
+
+static int addFunction(COMPILER *c, AST_NODE *body, int level)
+{
+    c->functions = reserve(c->functions, c->functionCount, &c->functionCapacity, sizeof(CILISP_FUNCTION));
+    c->bodies = reserve(c->bodies, c->functionCount, &c->bodiesCapacity, sizeof(AST_NODE *));
+
+    int index = c->functionCount++;
+    CILISP_FUNCTION *function = &c->functions[index];
+    function->entry = -1;
+    function->nArgs = 0;
+    function->nSlots = 0;
+    function->maxDepth = 0;
+    function->level = level;
+    c->bodies[index] = body;
+    return index;
+}
+
+// Returns the function compiled for a lambda, queueing the lambda for compilation the first time.
+static int lambdaFunction(COMPILER *c, SYM_TABLE_NODE *lambda)
+{
+    AST_NODE *body = lambda->value;
+    int index = functionIndexOf(c, body);
+    if (index >= 0)
+        return index;
+
+    int level = 0;
+    for (AST_NODE *node = body; node != NULL; node = functionRootOf(node->parent))
+        level++;
+
+    index = addFunction(c, body, level);
+    for (ARG_TABLE_NODE *arg = body->argTable; arg != NULL; arg = arg->next){
+        bindingFor(c, arg, index);
+        c->functions[index].nArgs++;
+    }
+    return index;
+}
+
+static int staticHops(COMPILER *c, int function)
+{
+    return c->functions[c->function].level - c->functions[function].level;
+}
+
+static void initLetVariable(COMPILER *c, AST_NODE *letNode, SYM_TABLE_NODE *var);
+
+// Makes sure every variable of letNode that subtree depends on, directly or through lambdas of
+// the same let, is stored before subtree runs.
+static void initDependencies(COMPILER *c, AST_NODE *letNode, AST_NODE *subtree, int mark)
+{
+    for (AST_NODE *node = subtree; node != NULL; node = node->next){
+        char *name = NULL;
+        switch (node->type){
+            case SYM_NODE_TYPE:
+                name = node->data.symbol.identifier;
+                break;
+            case FUNC_NODE_TYPE:
+                if (node->data.function.oper == CUSTOM_OPER)
+                    name = node->data.function.ident;
+                initDependencies(c, letNode, node->data.function.opList, mark);
+                break;
+            case COND_NODE_TYPE:
+                initDependencies(c, letNode, node->data.condition.cond, mark);
+                initDependencies(c, letNode, node->data.condition.nodeTrue, mark);
+                initDependencies(c, letNode, node->data.condition.nodeFalse, mark);
+                break;
+            case LOOP_NODE_TYPE:
+                name = node->data.loop.func;
+                initDependencies(c, letNode, node->data.loop.from, mark);
+                initDependencies(c, letNode, node->data.loop.to, mark);
+                initDependencies(c, letNode, node->data.loop.init, mark);
+                initDependencies(c, letNode, node->data.loop.body, mark);
+                break;
+            case BIND_NODE_TYPE:
+                initDependencies(c, letNode, node->data.bind.args, mark);
+                break;
+            default:
+                break;
+        }
+        for (SYM_TABLE_NODE *entry = node->table; entry != NULL; entry = entry->next)
+            initDependencies(c, letNode, entry->value, mark);
+
+        void *entry;
+        AST_NODE *owner;
+        if (name == NULL || c->failed)
+            continue;
+        switch (resolveSymbol(name, node, &entry, &owner)){
+            case RESOLVED_VARIABLE:
+                if (owner == letNode)
+                    initLetVariable(c, letNode, entry);
+                break;
+            case RESOLVED_LAMBDA:
+                if (owner == letNode){
+                    int binding = bindingFor(c, entry, -1);
+                    if (c->bindings[binding].scanMark != mark){
+                        c->bindings[binding].scanMark = mark;
+                        initDependencies(c, letNode, ((SYM_TABLE_NODE *) entry)->value, mark);
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void initLetVariable(COMPILER *c, AST_NODE *letNode, SYM_TABLE_NODE *var)
+{
+    int binding = bindingFor(c, var, c->function);
+    if (c->bindings[binding].state == BINDING_DONE)
+        return;
+    if (c->bindings[binding].state == BINDING_IN_PROGRESS){
+        compileError(c, "ERROR: variable %s depends on itself", var->id);
+        return;
+    }
+    c->bindings[binding].state = BINDING_IN_PROGRESS;
+
+    initDependencies(c, letNode, var->value, ++c->scanMark);
+
+    // declared types only cast number literals, the same as lookup
+    if (var->val_type != NO_TYPE && var->value->type == NUM_NODE_TYPE)
+        emitConst(c, var->val_type, var->value->data.number.value.dval);
+    else
+        compileNode(c, var->value);
+    emit(c, OP_STORE, 0, c->bindings[binding].slot, 0);
+    c->bindings[binding].state = BINDING_DONE;
+}
+
+// Forgets the bindings made in the current function since the first from, see compileGlobalVariable.
+static void dropLocalBindings(COMPILER *c, int from)
+{
+    int kept = from;
+    for (int i = from; i < c->bindingCount; i++){
+        if (c->bindings[i].function != c->function)
+            c->bindings[kept++] = c->bindings[i];
+    }
+    c->bindingCount = kept;
+}
+
+// A defined variable has no let to store it, its value is compiled where it is used, the same
+// way lookup evaluates it there. The loop variables, inlined params and let variables inside the
+// value are keyed by its nodes, which every use shares, so they are dropped again afterwards and
+// each use gets slots of its own in the function it is compiled into.
+static void compileGlobalVariable(COMPILER *c, SYM_TABLE_NODE *var)
+{
+    int binding = bindingFor(c, var, -1);
+    if (c->bindings[binding].state == BINDING_IN_PROGRESS){
+        compileError(c, "ERROR: variable %s depends on itself", var->id);
+        return;
+    }
+    c->bindings[binding].state = BINDING_IN_PROGRESS;
+    int firstLocal = c->bindingCount;
+    if (var->val_type != NO_TYPE && var->value->type == NUM_NODE_TYPE)
+        emitConst(c, var->val_type, var->value->data.number.value.dval);
+    else
+        compileNode(c, var->value);
+    dropLocalBindings(c, firstLocal);
+    c->bindings[binding].state = BINDING_PENDING;
+}
+
+static void compileSymbol(COMPILER *c, AST_NODE *node)
+{
+    char *name = node->data.symbol.identifier;
+    void *entry;
+    AST_NODE *owner;
+    int binding;
+
+    switch (resolveSymbol(name, node, &entry, &owner)){
+        case RESOLVED_VARIABLE:
+            if (owner == NULL){
+                compileGlobalVariable(c, entry);
+                break;
+            }
+            // fallthrough
+        case RESOLVED_ARG:
+            binding = bindingFor(c, entry, functionIndexOf(c, functionRootOf(owner)));
+            emit(c, OP_LOAD, staticHops(c, c->bindings[binding].function), c->bindings[binding].slot, 0);
+            break;
+        case RESOLVED_LAMBDA:
+            compileError(c, "ERROR: lambda %s used as a value", name);
+            break;
+        case RESOLVED_NONE:
+            for (int i = 0; i < c->inputCount; i++){
+                if (strcmp(c->inputNames[i], name) == 0){
+                    emit(c, OP_INPUT, i, 0, 0);
+                    return;
+                }
+            }
+            compileError(c, "ERROR: Invalid symbol %s given!", name);
+            break;
+    }
+}
+
+static int operandCount(AST_NODE *opList)
+{
+    int count = 0;
+    for (; opList != NULL; opList = opList->next)
+        count++;
+    return count;
+}
+
+static void compileCall(COMPILER *c, AST_NODE *node, char *name, AST_NODE *opList, int count)
+{
+    void *entry;
+    AST_NODE *owner;
+    if (resolveSymbol(name, node, &entry, &owner) != RESOLVED_LAMBDA){
+        compileError(c, "ERROR: %s is not a lambda", name);
+        return;
+    }
+
+    int function = lambdaFunction(c, entry);
+    int nArgs = c->functions[function].nArgs;
+    if (count < nArgs){
+        compileError(c, "ERROR: NOT ENOUGH PARAMETERS FOR CUSTOM FUNCTION %s", name);
+        return;
+    }
+
+    // extra operands are ignored, the same as CUSTOM_OPER
+    for (int i = 0; i < nArgs; i++, opList = opList->next)
+        compileNode(c, opList);
+    emit(c, OP_CALL, function, nArgs, c->functions[c->function].level - (c->functions[function].level - 1));
+    if (((SYM_TABLE_NODE *) entry)->val_type != NO_TYPE)
+        emit(c, OP_CAST, ((SYM_TABLE_NODE *) entry)->val_type, 0, 0);
+}
+
+// An inlined call, the params get slots in the current frame.
+static void compileBind(COMPILER *c, AST_NODE *node)
+{
+    BIND_AST_NODE *bind = &node->data.bind;
+    ARG_TABLE_NODE *param = bind->body->argTable;
+    for (AST_NODE *arg = bind->args; arg != NULL; arg = arg->next, param = param->next){
+        compileNode(c, arg);
+        int binding = bindingFor(c, param, c->function);
+        emit(c, OP_STORE, 0, c->bindings[binding].slot, 0);
+    }
+    compileNode(c, bind->body);
+    if (bind->type != NO_TYPE)
+        emit(c, OP_CAST, bind->type, 0, 0);
+}
+
+static void compileFunc(COMPILER *c, AST_NODE *node)
+{
+    FUNC_AST_NODE *funcNode = &node->data.function;
+    AST_NODE *traversal = funcNode->opList;
+    int count = operandCount(traversal);
+
+    switch (funcNode->oper){
+        case NEG_OPER:
+        case ABS_OPER:
+        case EXP_OPER:
+        case SQRT_OPER:
+        case LOG_OPER:
+        case EXP2_OPER:
+        case CBRT_OPER:
+            if (count < 1){
+                compileError(c, "ERROR: Too few parameters for function %s", funcNames[funcNode->oper]);
+                return;
+            }
+            compileNode(c, traversal);
+            emit(c, OP_UNARY, funcNode->oper, 0, 0);
+            break;
+
+        case ADD_OPER:
+            emitConst(c, INT_TYPE, 0);
+            for (; traversal != NULL; traversal = traversal->next){
+                compileNode(c, traversal);
+                emit(c, OP_BINARY, ADD_OPER, 0, 0);
+            }
+            break;
+
+        case SUB_OPER:
+        case MULT_OPER:
+        case DIV_OPER:
+        case MAX_OPER:
+        case MIN_OPER:
+        case HYPOT_OPER:
+            if (count < (funcNode->oper == SUB_OPER ? 1 : 2)){
+                compileError(c, "ERROR: Too few parameters for function %s", funcNames[funcNode->oper]);
+                return;
+            }
+            compileNode(c, traversal);
+            for (traversal = traversal->next; traversal != NULL; traversal = traversal->next){
+                compileNode(c, traversal);
+                emit(c, OP_BINARY, funcNode->oper, 0, 0);
+            }
+            break;
+
+        case REMAINDER_OPER:
+        case POW_OPER:
+        case LESS_OPER:
+        case GREATER_OPER:
+        case EQUAL_OPER:
+            if (count < 2){
+                compileError(c, "ERROR: Too few parameters for function %s", funcNames[funcNode->oper]);
+                return;
+            }
+            compileNode(c, traversal);
+            compileNode(c, traversal->next);
+            emit(c, OP_BINARY, funcNode->oper, 0, 0);
+            break;
+
+        case RAND_OPER:
+            emit(c, OP_RAND, 0, 0, 0);
+            break;
+
+        case PRINT_OPER:
+            if (count < 1){
+                compileError(c, "ERROR: Too few parameters for function %s", funcNames[funcNode->oper]);
+                return;
+            }
+            for (; traversal != NULL; traversal = traversal->next)
+                compileNode(c, traversal);
+            emit(c, OP_PRINT, 0, count, 0);
+            break;
+
+        case READ_OPER:
+        case MEMSTATS_OPER:
+        case CACHESTATS_OPER:
+            compileError(c, "ERROR: %s is not supported in compiled programs", funcNames[funcNode->oper]);
+            break;
+
+        case CUSTOM_OPER:
+            compileCall(c, node, funcNode->ident, traversal, count);
+            break;
+    }
+}
+
+static void compileCond(COMPILER *c, COND_AST_NODE *condNode)
+{
+    compileNode(c, condNode->cond);
+    int jumpFalse = emit(c, OP_JUMP_FALSE, 0, 0, 0);
+    int depth = c->depth;
+    compileNode(c, condNode->nodeTrue);
+    int jumpEnd = emit(c, OP_JUMP, 0, 0, 0);
+    c->code[jumpFalse].a = c->codeLength;
+    c->depth = depth;
+    compileNode(c, condNode->nodeFalse);
+    c->code[jumpEnd].a = c->codeLength;
+}
+
+static void compileLoop(COMPILER *c, AST_NODE *node)
+{
+    LOOP_AST_NODE *loopNode = &node->data.loop;
+    int var, acc, function = 0;
+    NUM_TYPE returnType = NO_TYPE;
+
+    if (loopNode->type == REDUCE_LOOP){
+        void *entry;
+        AST_NODE *owner;
+        if (resolveSymbol(loopNode->func, node, &entry, &owner) != RESOLVED_LAMBDA){
+            compileError(c, "ERROR: %s is not a lambda", loopNode->func);
+            return;
+        }
+        function = lambdaFunction(c, entry);
+        returnType = ((SYM_TABLE_NODE *) entry)->val_type;
+        if (c->functions[function].nArgs != 2){
+            compileError(c, "ERROR: reduce needs a lambda with two parameters (acc i), %s has a different count", loopNode->func);
+            return;
+        }
+        var = newSlot(c);
+        acc = newSlot(c);
+    } else {
+        ARG_TABLE_NODE *args = loopNode->body->argTable;
+        int binding = bindingFor(c, args, c->function);
+        var = c->bindings[binding].slot;
+        if (args->next != NULL){
+            binding = bindingFor(c, args->next, c->function);
+            acc = c->bindings[binding].slot;
+        } else {
+            acc = newSlot(c);
+        }
+    }
+    int end = newSlot(c);
+
+    compileNode(c, loopNode->from);
+    emit(c, OP_TRUNC, 0, 0, 0);
+    emit(c, OP_STORE, 0, var, 0);
+    compileNode(c, loopNode->to);
+    emit(c, OP_TRUNC, 0, 0, 0);
+    emit(c, OP_STORE, 0, end, 0);
+    switch (loopNode->type){
+        case SUM_LOOP:
+            emitConst(c, INT_TYPE, 0);
+            break;
+        case PROD_LOOP:
+            emitConst(c, INT_TYPE, 1);
+            break;
+        default:
+            compileNode(c, loopNode->init);
+            break;
+    }
+    emit(c, OP_STORE, 0, acc, 0);
+
+    int top = c->codeLength;
+    int test = emit(c, OP_LOOP_TEST, var, end, 0);
+    switch (loopNode->type){
+        case SUM_LOOP:
+        case PROD_LOOP:
+            emit(c, OP_LOAD, 0, acc, 0);
+            compileNode(c, loopNode->body);
+            emit(c, OP_BINARY, loopNode->type == SUM_LOOP ? ADD_OPER : MULT_OPER, 0, 0);
+            break;
+        case LOOP_LOOP:
+            compileNode(c, loopNode->body);
+            break;
+        case REDUCE_LOOP:
+            emit(c, OP_LOAD, 0, acc, 0);
+            emit(c, OP_LOAD, 0, var, 0);
+            emit(c, OP_CALL, function, 2, c->functions[c->function].level - (c->functions[function].level - 1));
+            if (returnType != NO_TYPE)
+                emit(c, OP_CAST, returnType, 0, 0);
+            break;
+    }
+    emit(c, OP_STORE, 0, acc, 0);
+    emit(c, OP_INC, var, 0, 0);
+    emit(c, OP_JUMP, top, 0, 0);
+    c->code[test].c = c->codeLength;
+    emit(c, OP_LOAD, 0, acc, 0);
+}
+
+static void compileNode(COMPILER *c, AST_NODE *node)
+{
+    if (c->failed)
+        return;
+
+    for (SYM_TABLE_NODE *entry = node->table; entry != NULL && !c->failed; entry = entry->next){
+        if (entry->type == VARIABLE_TYPE)
+            initLetVariable(c, node, entry);
+    }
+
+    switch (node->type){
+        case NUM_NODE_TYPE:
+            emitConst(c, node->data.number.type, node->data.number.value.dval);
+            break;
+        case FUNC_NODE_TYPE:
+            compileFunc(c, node);
+            break;
+        case SYM_NODE_TYPE:
+            compileSymbol(c, node);
+            break;
+        case COND_NODE_TYPE:
+            compileCond(c, &node->data.condition);
+            break;
+        case LOOP_NODE_TYPE:
+            compileLoop(c, node);
+            break;
+        case BIND_NODE_TYPE:
+            compileBind(c, node);
+            break;
+    }
+}
+
+static void freeCompiler(COMPILER *c)
+{
+    ciLispFree(c->code);
+    ciLispFree(c->functions);
+    ciLispFree(c->bodies);
+    ciLispFree(c->bindings);
+}
+
+// Compiles root and every lambda it can call into a single block:
+// instructions, then functions, then the input names.
+CILISP_PROGRAM *compileProgram(AST_NODE *root, const char *const *inputNames, int inputCount)
+{
+    COMPILER c = {0};
+    c.inputNames = inputNames;
+    c.inputCount = inputCount;
+
+    addFunction(&c, NULL, 0);
+    c.functions[0].entry = 0;
+    compileNode(&c, root);
+    emit(&c, OP_HALT, 0, 0, 0);
+
+    // compiling a function can queue more lambdas, so functionCount grows while this runs
+    for (int i = 1; i < c.functionCount && !c.failed; i++){
+        c.function = i;
+        c.depth = 0;
+        c.functions[i].entry = c.codeLength;
+        compileNode(&c, c.bodies[i]);
+        emit(&c, OP_RETURN, 0, 0, 0);
+    }
+
+    if (c.failed){
+        freeCompiler(&c);
+        return NULL;
+    }
+
+    size_t namesSize = 0;
+    for (int i = 0; i < inputCount; i++)
+        namesSize += strlen(inputNames[i]) + 1;
+    size_t codeSize = c.codeLength * sizeof(CILISP_INSTR);
+    size_t functionsSize = c.functionCount * sizeof(CILISP_FUNCTION);
+
+    CILISP_PROGRAM *program;
+    if ((program = ciLispAlloc(sizeof(CILISP_PROGRAM), MEM_PROGRAM)) == NULL
+        || (program->block = ciLispAlloc(codeSize + functionsSize + namesSize, MEM_PROGRAM)) == NULL){
+        yyerror("Memory allocation failed!");
+        ciLispFree(program);
+        freeCompiler(&c);
+        return NULL;
+    }
+
+    char *block = program->block;
+    memcpy(block, c.code, codeSize);
+    memcpy(block + codeSize, c.functions, functionsSize);
+    char *names = block + codeSize + functionsSize;
+    for (int i = 0; i < inputCount; i++){
+        strcpy(names, inputNames[i]);
+        names += strlen(inputNames[i]) + 1;
+    }
+
+    program->code = (CILISP_INSTR *) block;
+    program->codeLength = c.codeLength;
+    program->functions = (CILISP_FUNCTION *) (block + codeSize);
+    program->functionCount = c.functionCount;
+    program->inputNames = block + codeSize + functionsSize;
+    program->inputCount = inputCount;
+
+    freeCompiler(&c);
+    return program;
+}
+
+static void printValue(RET_VAL val)
+{
+    if (val.type == DOUBLE_TYPE)
+        printf("%.2lf ", val.value.dval);
+    else
+        printf("%.0lf ", val.value.dval);
+}
+
+// Runs a compiled program. All state lives in this stack frame, the program is only read.
+CILISP_STATUS runProgram(const CILISP_PROGRAM *program, const double *inputs, RET_VAL *result)
+{
+    RET_VAL stack[PROGRAM_STACK_SIZE];
+    PROGRAM_FRAME frames[PROGRAM_FRAME_COUNT];
+    EVAL_BUDGET budget; // a step per call and loop iteration, everything else runs straight through
+    const CILISP_INSTR *code = program->code;
+    const CILISP_FUNCTION *functions = program->functions;
+
+    if (functions[0].nSlots + functions[0].maxDepth > PROGRAM_STACK_SIZE)
+        return CILISP_STACK_OVERFLOW;
+
+    int sp = functions[0].nSlots;
+    int fp = 0;
+    int pc = functions[0].entry;
+    frames[0].base = 0;
+    frames[0].link = -1;
+    frames[0].returnPc = -1;
+    for (int i = 0; i < sp; i++)
+        stack[i] = (RET_VAL){INT_TYPE, {0}};
+    startBudget(&budget);
+
+    while (true){
+        const CILISP_INSTR *instr = &code[pc++];
+        switch (instr->op){
+            case OP_CONST:
+                stack[sp++] = instr->value;
+                break;
+
+            case OP_INPUT:
+                stack[sp].type = DOUBLE_TYPE;
+                stack[sp++].value.dval = inputs[instr->a];
+                break;
+
+            case OP_LOAD: {
+                int frame = fp;
+                for (int hops = instr->a; hops > 0; hops--)
+                    frame = frames[frame].link;
+                stack[sp++] = stack[frames[frame].base + instr->b];
+                break;
+            }
+
+            case OP_STORE:
+                stack[frames[fp].base + instr->b] = stack[--sp];
+                break;
+
+            case OP_UNARY:
+                stack[sp - 1] = applyUnary(instr->a, stack[sp - 1]);
+                break;
+
+            case OP_BINARY:
+                sp--;
+                stack[sp - 1] = applyBinary(instr->a, stack[sp - 1], stack[sp]);
+                break;
+
+            case OP_TRUNC:
+                if (!(fabs(stack[sp - 1].value.dval) < LOOP_BOUND_LIMIT))
+                    return CILISP_RANGE_ERROR;
+                stack[sp - 1].type = INT_TYPE;
+                stack[sp - 1].value.dval = trunc(stack[sp - 1].value.dval);
+                break;
+
+            case OP_CAST:
+                stack[sp - 1] = applyReturnType(instr->a, stack[sp - 1]);
+                break;
+
+            case OP_JUMP:
+                pc = instr->a;
+                break;
+
+            case OP_JUMP_FALSE:
+                if (stack[--sp].value.dval == 0)
+                    pc = instr->a;
+                break;
+
+            case OP_LOOP_TEST:
+                if (++budget.steps >= budget.nextCheck && !budgetLeft(&budget))
+                    return CILISP_BUDGET_EXCEEDED;
+                if (stack[frames[fp].base + instr->a].value.dval > stack[frames[fp].base + instr->b].value.dval)
+                    pc = instr->c;
+                break;
+
+            case OP_INC:
+                stack[frames[fp].base + instr->a].value.dval += 1;
+                break;
+
+            case OP_CALL: {
+                if (++budget.steps >= budget.nextCheck && !budgetLeft(&budget))
+                    return CILISP_BUDGET_EXCEEDED;
+                const CILISP_FUNCTION *function = &functions[instr->a];
+                int base = sp - instr->b;
+                if (fp + 1 >= PROGRAM_FRAME_COUNT || base + function->nSlots + function->maxDepth > PROGRAM_STACK_SIZE)
+                    return CILISP_STACK_OVERFLOW;
+                for (sp = base + instr->b; sp < base + function->nSlots; sp++)
+                    stack[sp] = (RET_VAL){INT_TYPE, {0}};
+                int link = fp;
+                for (int hops = instr->c; hops > 0; hops--)
+                    link = frames[link].link;
+                fp++;
+                frames[fp].base = base;
+                frames[fp].link = link;
+                frames[fp].returnPc = pc;
+                pc = function->entry;
+                break;
+            }
+
+            case OP_RETURN:
+                stack[frames[fp].base] = stack[sp - 1];
+                sp = frames[fp].base + 1;
+                pc = frames[fp].returnPc;
+                fp--;
+                break;
+
+            case OP_RAND:
+                stack[sp].type = DOUBLE_TYPE;
+                stack[sp++].value.dval = (double) rand() / RAND_MAX;
+                break;
+
+            case OP_PRINT:
+                printf("PRINT: ");
+                for (int i = sp - instr->b; i < sp; i++)
+                    printValue(stack[i]);
+                printf("\n");
+                stack[sp - instr->b] = stack[sp - 1];
+                sp -= instr->b - 1;
+                break;
+
+            case OP_HALT:
+                *result = stack[sp - 1];
+                return CILISP_OK;
+        }
+    }
+}
+
+// Code range of function i: functions are compiled one after another, so each one's code runs up
+// to the next entry.
+static int functionEnd(const CILISP_PROGRAM *program, int i)
+{
+    return i + 1 < program->functionCount ? program->functions[i + 1].entry : program->codeLength;
+}
+
+// Function whose frame is hops links up from a frame of function, -1 if the chain is shorter.
+// enclosing[f] is the function a frame of f links to (see OP_CALL), -1 for function 0.
+static int enclosingFunction(const int *enclosing, int function, int hops)
+{
+    while (hops-- > 0 && function >= 0)
+        function = enclosing[function];
+    return function;
+}
+
+// Works out enclosing (see enclosingFunction) from the calls, starting at function 0. Every call
+// of a function has to link it to the same enclosing function, one level further out, as
+// compileProgram does. Functions no call reaches are left at -2.
+static bool linkFunctions(const CILISP_PROGRAM *program, int *enclosing)
+{
+    const CILISP_INSTR *code = program->code;
+    const CILISP_FUNCTION *functions = program->functions;
+    enclosing[0] = -1;
+    for (int i = 1; i < program->functionCount; i++)
+        enclosing[i] = -2;
+
+    bool changed = true;
+    while (changed){
+        changed = false;
+        for (int f = 0; f < program->functionCount; f++){
+            if (enclosing[f] == -2)
+                continue;
+            for (int pc = functions[f].entry; pc < functionEnd(program, f); pc++){
+                if (code[pc].op != OP_CALL)
+                    continue;
+                int callee = code[pc].a;
+                int link = enclosingFunction(enclosing, f, code[pc].c);
+                if (link < 0 || functions[callee].level != functions[link].level + 1)
+                    return false;
+                if (enclosing[callee] == -2){
+                    enclosing[callee] = link;
+                    changed = true;
+                } else if (enclosing[callee] != link){
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Traces the operand stack depth of function f through every path from its entry: each instruction
+// must find the operands it pops, stay within maxDepth, and be reached with the same depth from
+// every path. RETURN and HALT leave the result on top. depths and work hold one int per instruction.
+static bool validDepths(const CILISP_PROGRAM *program, int f, int *depths, int *work)
+{
+    const CILISP_INSTR *code = program->code;
+    const CILISP_FUNCTION *function = &program->functions[f];
+    int end = functionEnd(program, f);
+    for (int pc = function->entry; pc < end; pc++)
+        depths[pc] = -1;
+
+    int pending = 0;
+    depths[function->entry] = 0;
+    work[pending++] = function->entry;
+    while (pending > 0){
+        int pc = work[--pending];
+        const CILISP_INSTR *instr = &code[pc];
+        int depth = depths[pc];
+        int pops = 0;
+        int pushes = 0;
+        int next[2] = {pc + 1, -1};
+        switch (instr->op){
+            case OP_CONST:
+            case OP_INPUT:
+            case OP_LOAD:
+            case OP_RAND:
+                pushes = 1;
+                break;
+            case OP_STORE:
+                pops = 1;
+                break;
+            case OP_UNARY:
+            case OP_TRUNC:
+            case OP_CAST:
+                pops = pushes = 1;
+                break;
+            case OP_BINARY:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_JUMP:
+                next[0] = instr->a;
+                break;
+            case OP_JUMP_FALSE:
+                pops = 1;
+                next[1] = instr->a;
+                break;
+            case OP_LOOP_TEST:
+                next[1] = instr->c;
+                break;
+            case OP_CALL:
+            case OP_PRINT:
+                pops = instr->b;
+                pushes = 1;
+                break;
+            case OP_RETURN:
+            case OP_HALT:
+                pops = 1;
+                next[0] = -1;
+                break;
+            default:
+                break;
+        }
+        if (depth < pops || depth - pops + pushes > function->maxDepth)
+            return false;
+        depth += pushes - pops;
+
+        for (int i = 0; i < 2; i++){
+            if (next[i] < 0)
+                continue;
+            if (depths[next[i]] < 0){
+                depths[next[i]] = depth;
+                work[pending++] = next[i];
+            } else if (depths[next[i]] != depth){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Checks what runProgram takes on trust: every opcode, builtin, type, input, function, jump target
+// and slot is in range, function 0 starts at 0 and ends in a HALT and every other function ends in a
+// RETURN. Jumps only go back to a loop test, so the step budget sees every loop. Frames are followed
+// the way runProgram links them, so a load is checked against the slots of the function whose frame
+// it reads, and operand stack depths are traced (see validDepths).
+// Used on images (ciLispImage.c), which come from a file rather than from compileProgram.
+bool validProgram(const CILISP_PROGRAM *program)
+{
+    const CILISP_INSTR *code = program->code;
+    const CILISP_FUNCTION *functions = program->functions;
+    if (program->codeLength < 1 || program->functionCount < 1 || functions[0].entry != 0)
+        return false;
+
+    for (int i = 0; i < program->functionCount; i++){
+        const CILISP_FUNCTION *function = &functions[i];
+        int end = functionEnd(program, i);
+        if (function->entry < 0 || function->entry >= end || end > program->codeLength
+            || function->nArgs < 0 || function->nArgs > function->nSlots || function->maxDepth < 0
+            || function->nSlots > PROGRAM_STACK_SIZE || function->maxDepth > PROGRAM_STACK_SIZE
+            || (i == 0 ? function->level != 0 : function->level < 1)
+            || code[end - 1].op != (i == 0 ? OP_HALT : OP_RETURN))
+            return false;
+    }
+
+    for (int i = 0; i < program->functionCount; i++){
+        const CILISP_FUNCTION *function = &functions[i];
+        int end = functionEnd(program, i);
+        for (int pc = function->entry; pc < end; pc++){
+            const CILISP_INSTR *instr = &code[pc];
+            bool valid;
+            switch (instr->op){
+                case OP_INPUT:
+                    valid = instr->a >= 0 && instr->a < program->inputCount;
+                    break;
+                case OP_LOAD:
+                    valid = instr->a >= 0 && instr->a <= function->level && instr->b >= 0;
+                    break;
+                case OP_STORE:
+                    valid = instr->b >= 0 && instr->b < function->nSlots;
+                    break;
+                case OP_INC:
+                    valid = instr->a >= 0 && instr->a < function->nSlots;
+                    break;
+                case OP_UNARY:
+                case OP_BINARY:
+                    valid = instr->a >= 0 && instr->a <= CACHESTATS_OPER;
+                    break;
+                case OP_CAST:
+                    valid = instr->a >= 0 && instr->a <= NO_TYPE;
+                    break;
+                case OP_JUMP:
+                case OP_JUMP_FALSE:
+                    // the only way back is to a loop test, which counts against the budget
+                    valid = instr->a >= function->entry && instr->a < end
+                            && (instr->a > pc || code[instr->a].op == OP_LOOP_TEST);
+                    break;
+                case OP_LOOP_TEST:
+                    valid = instr->a >= 0 && instr->a < function->nSlots && instr->b >= 0 && instr->b < function->nSlots
+                            && instr->c > pc && instr->c < end;
+                    break;
+                case OP_CALL:
+                    valid = instr->a > 0 && instr->a < program->functionCount && instr->b == functions[instr->a].nArgs
+                            && instr->c >= 0 && instr->c <= function->level;
+                    break;
+                case OP_PRINT:
+                    valid = instr->b > 0;
+                    break;
+                case OP_RETURN:
+                    valid = i != 0;
+                    break;
+                case OP_HALT:
+                    valid = i == 0;
+                    break;
+                case OP_CONST:
+                case OP_TRUNC:
+                case OP_RAND:
+                    valid = true;
+                    break;
+                default:
+                    valid = false;
+                    break;
+            }
+            if (!valid)
+                return false;
+        }
+    }
+
+    int *enclosing;
+    int *depths;
+    int *work;
+    if ((enclosing = ciLispAlloc(program->functionCount * sizeof(int), MEM_PROGRAM)) == NULL)
+        return false;
+    if ((depths = ciLispAlloc(2 * program->codeLength * sizeof(int), MEM_PROGRAM)) == NULL){
+        ciLispFree(enclosing);
+        return false;
+    }
+    work = depths + program->codeLength;
+
+    bool valid = linkFunctions(program, enclosing);
+    for (int i = 0; valid && i < program->functionCount; i++){
+        // functions no call reaches never run
+        if (enclosing[i] == -2)
+            continue;
+        valid = validDepths(program, i, depths, work);
+        for (int pc = functions[i].entry; valid && pc < functionEnd(program, i); pc++){
+            if (code[pc].op != OP_LOAD)
+                continue;
+            int frame = enclosingFunction(enclosing, i, code[pc].a);
+            valid = frame >= 0 && code[pc].b < functions[frame].nSlots;
+        }
+    }
+
+    ciLispFree(depths);
+    ciLispFree(enclosing);
+    return valid;
+}
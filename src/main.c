@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ciLispApi.h"
+
+// --csv/--tsv mode, streams stdin through one lambda and writes the results to stdout.
+// The lambda is compiled from source, or mapped from an image with --csv-image/--tsv-image.
+// errorFd is the real stderr, the bad row count goes there so it stays out of the results.
+static int runCsv(const char *source, const char *image, CILISP_CSV_OPTIONS *options, int errorFd)
+{
+    CILISP_STATUS status;
+    CILISP_PROGRAM *program = image != NULL ? ciLispLoadImage(image, &status) : ciLispCompile(source, NULL, 0, &status);
+    if (program == NULL){
+        fprintf(stdout, "ERROR: %s in \"%s\"\n", ciLispStatusMessage(status), image != NULL ? image : source);
+        return EXIT_FAILURE;
+    }
+
+    status = ciLispRunCsv(program, stdin, stdout, options);
+    ciLispFreeProgram(program);
+    if (status != CILISP_OK){
+        fprintf(stdout, "ERROR: %s\n", ciLispStatusMessage(status));
+        return EXIT_FAILURE;
+    }
+    if (options->badRows > 0)
+        dprintf(errorFd, "%ld bad rows\n", options->badRows);
+    return EXIT_SUCCESS;
+}
+
+// --save-image mode, compiles the --csv/--tsv lambda and writes it to path instead of running it.
+static int saveImage(const char *source, const char *path)
+{
+    CILISP_STATUS status;
+    CILISP_PROGRAM *program = ciLispCompile(source, NULL, 0, &status);
+    if (program != NULL){
+        status = ciLispSaveImage(program, path);
+        ciLispFreeProgram(program);
+    }
+    if (status != CILISP_OK){
+        fprintf(stdout, "ERROR: %s in \"%s\"\n", ciLispStatusMessage(status), program == NULL ? source : path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// The cilisp REPL, a thin client of libcilisp.
+int main(int argc, char **argv) {
+
+    int errorFd = dup(STDERR_FILENO);
+    freopen("/dev/null", "w", stderr); // comment out to see the lex/yacc debug printouts
+
+    const char *csvSource = NULL;
+    const char *csvImage = NULL;
+    const char *savePath = NULL;
+    bool pipelined = false;
+    unsigned long stepBudget = 0;
+    double deadlineMs = 0;
+    CILISP_CSV_OPTIONS csvOptions = {',', false, 0, 0};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mem-report") == 0)
+            ciLispEnableMemReport();
+        else if (strcmp(argv[i], "--strict-mem") == 0)
+            ciLispSetStrictMem(true);
+        else if ((strcmp(argv[i], "--csv") == 0 || strcmp(argv[i], "--tsv") == 0) && i + 1 < argc) {
+            csvOptions.delimiter = argv[i][2] == 't' ? '\t' : ',';
+            csvSource = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--csv-image") == 0 || strcmp(argv[i], "--tsv-image") == 0) && i + 1 < argc) {
+            csvOptions.delimiter = argv[i][2] == 't' ? '\t' : ',';
+            csvImage = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc)
+            savePath = argv[++i];
+        else if (strcmp(argv[i], "--header") == 0)
+            csvOptions.header = true;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            csvOptions.threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-inline") == 0)
+            ciLispSetInlining(false);
+        else if (strcmp(argv[i], "--fast-math") == 0)
+            ciLispSetFastMath(true);
+        else if (strcmp(argv[i], "--pipeline") == 0)
+            pipelined = true;
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            ciLispSetResultCache(strtoul(argv[++i], NULL, 10));
+        else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+            stepBudget = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc)
+            deadlineMs = atof(argv[++i]);
+        else if (strcmp(argv[i], "--eval-report") == 0)
+            ciLispSetEvalReport(true);
+    }
+    ciLispSetBudget(stepBudget, deadlineMs / 1000);
+
+    if (csvSource != NULL && savePath != NULL)
+        return saveImage(csvSource, savePath);
+
+    if (csvSource != NULL || csvImage != NULL)
+        return runCsv(csvSource, csvImage, &csvOptions, errorFd);
+
+    if (pipelined) {
+        ciLispRunPipeline(stdin);
+        return EXIT_SUCCESS;
+    }
+
+    char *s_expr_str = NULL;
+    size_t s_expr_str_len = 0;
+    while (true) {
+        printf("\n> ");
+        if (getline(&s_expr_str, &s_expr_str_len, stdin) == -1)
+            break;
+        if (!ciLispRunLine(s_expr_str))
+            break;
+    }
+    free(s_expr_str);
+    return EXIT_SUCCESS;
+}